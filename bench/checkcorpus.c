@@ -0,0 +1,244 @@
+//--------------------------------------------------------------------------
+// checkcorpus - check the counts finddupe reports on a gencorpus tree
+//
+// Builds the tree with gencorpus, which tells how many duplicates finddupe
+// should report (files with the content of a file listed before them, that
+// are not hardlinks to it) and how many files have hardlinks made to them.
+// Then runs finddupe on it in report mode, once with each of a set of
+// options that take other paths through the reads (one thread, each cache
+// hint, direct reads, more tiers), and in -listlink mode.  The duplicates
+// and hardlink groups finddupe reports must match what gencorpus made, and
+// finddupe must not fail to open or read any file.
+//
+// Version 1.35  Oct 2026
+//
+// This file is part of finddupe.
+//
+// finddupe is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//--------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tchar.h>
+
+#define WIN32_LEAN_AND_MEAN
+#define _WIN32_WINNT 0x0500
+#include <windows.h>
+
+// Options finddupe is run with in report mode, each must give the same counts.
+static const TCHAR * ReportOptions[] = {
+    TEXT(""),
+    TEXT("-threads 1"),
+    TEXT("-cache none"),
+    TEXT("-cache drop"),
+    TEXT("-direct"),
+    TEXT("-tiers head:4k,tail:4k,sample:8:4k"),
+};
+#define NUM_REPORT_OPTIONS (int)(sizeof(ReportOptions) / sizeof(ReportOptions[0]))
+
+static const TCHAR * ExeName = TEXT("finddupe.exe");
+static const TCHAR * GenName = TEXT("gencorpus.exe");
+static const TCHAR * GenOptions;
+static const TCHAR * TreeDir;
+static int Failures;
+
+//--------------------------------------------------------------------------
+// Run a command and return its exit code, with what it wrote to stdout and
+// stderr in Output (free it).  finddupe writes UTF-16 when built for
+// Unicode, that is narrowed to the ASCII the counts are in.
+//--------------------------------------------------------------------------
+static DWORD RunCapture(TCHAR * CmdLine, char ** Output)
+{
+    STARTUPINFO Startup;
+    PROCESS_INFORMATION Proc;
+    SECURITY_ATTRIBUTES Inherit;
+    TCHAR TempDir[MAX_PATH], TempName[MAX_PATH];
+    HANDLE Out;
+    DWORD ExitCode, Size, Bytes, a;
+    char * Text;
+
+    if (GetTempPath(MAX_PATH, TempDir) == 0) _tcscpy(TempDir, TEXT("."));
+    if (GetTempFileName(TempDir, TEXT("chk"), 0, TempName) == 0){
+        _ftprintf(stderr, TEXT("Could not create a temporary file\n"));
+        exit(EXIT_FAILURE);
+    }
+
+    Inherit.nLength = sizeof(Inherit);
+    Inherit.lpSecurityDescriptor = NULL;
+    Inherit.bInheritHandle = TRUE;
+    Out = CreateFile(TempName, GENERIC_READ | GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                     &Inherit, CREATE_ALWAYS, FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, NULL);
+    if (Out == INVALID_HANDLE_VALUE){
+        _ftprintf(stderr, TEXT("Could not create '%s'\n"), TempName);
+        exit(EXIT_FAILURE);
+    }
+
+    memset(&Startup, 0, sizeof(Startup));
+    Startup.cb = sizeof(Startup);
+    Startup.dwFlags = STARTF_USESTDHANDLES;
+    Startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    Startup.hStdOutput = Out;
+    Startup.hStdError = Out;
+
+    if (!CreateProcess(NULL, CmdLine, NULL, NULL, TRUE, 0, NULL, NULL, &Startup, &Proc)){
+        _ftprintf(stderr, TEXT("Could not run '%s' (error %lu)\n"), CmdLine, GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    WaitForSingleObject(Proc.hProcess, INFINITE);
+    GetExitCodeProcess(Proc.hProcess, &ExitCode);
+    CloseHandle(Proc.hThread);
+    CloseHandle(Proc.hProcess);
+
+    Size = GetFileSize(Out, NULL);
+    Text = (char *)malloc(Size + 2);
+    if (Text == NULL){
+        _ftprintf(stderr, TEXT("Malloc failure\n"));
+        exit(EXIT_FAILURE);
+    }
+    SetFilePointer(Out, 0, NULL, FILE_BEGIN);
+    if (!ReadFile(Out, Text, Size, &Bytes, NULL)) Bytes = 0;
+    CloseHandle(Out);
+    Text[Bytes] = Text[Bytes+1] = '\0';
+
+    if (Bytes >= 2 && Text[1] == '\0'){
+        for (a = 0; a < Bytes / 2; a++) Text[a] = Text[a*2];
+        Text[a] = '\0';
+    }
+    *Output = Text;
+    return ExitCode;
+}
+
+//--------------------------------------------------------------------------
+// The number after Key (and after After, if given, further on the line) in
+// the output, or -1 if it is not there.
+//--------------------------------------------------------------------------
+static int FindCount(const char * Output, const char * Key, const char * After)
+{
+    const char * p = strstr(Output, Key);
+    if (p == NULL) return -1;
+    p += strlen(Key);
+    if (After){
+        const char * EndOfLine = strchr(p, '\n');
+        p = strstr(p, After);
+        if (p == NULL || (EndOfLine && p > EndOfLine)) return -1;
+        p += strlen(After);
+    }
+    while (*p == ' ') p++;
+    if (*p < '0' || *p > '9') return -1;
+    return atoi(p);
+}
+
+static void Check(const TCHAR * What, const TCHAR * Options, int Found, int Expected)
+{
+    if (Found == Expected){
+        _tprintf(TEXT("  ok      %-9s %-38s %d\n"), What, Options, Found);
+    }else{
+        _tprintf(TEXT("  FAILED  %-9s %-38s %d, expected %d\n"), What, Options, Found, Expected);
+        Failures += 1;
+    }
+    fflush(stdout);
+}
+
+//--------------------------------------------------------------------------
+// Run finddupe with the given options on the tree.
+//--------------------------------------------------------------------------
+static char * RunFinddupe(const TCHAR * Options)
+{
+    TCHAR CmdLine[1024];
+    char * Output;
+    DWORD ExitCode;
+
+    _sntprintf(CmdLine, 1024, TEXT("\"%s\" -p %s \"%s\\**\""), ExeName, Options, TreeDir);
+    CmdLine[1023] = 0;
+    ExitCode = RunCapture(CmdLine, &Output);
+    if (ExitCode != 0){
+        _tprintf(TEXT("  FAILED  '%s' exit code %lu\n"), CmdLine, ExitCode);
+        Failures += 1;
+    }
+    return Output;
+}
+
+static void Usage (void)
+{
+    _tprintf(TEXT("checkcorpus - check the counts finddupe reports on a gencorpus tree\n\n"));
+    _tprintf(TEXT("Usage: checkcorpus [options] -gen <options> <dir>\n"));
+    _tprintf(TEXT("Options:\n")
+           TEXT(" -gen <options>  Build the tree with gencorpus and these options (one\n")
+           TEXT("                 argument, quoted)\n")
+           TEXT(" -exe <file>     finddupe to run (default: finddupe.exe)\n")
+           TEXT(" -genexe <file>  gencorpus to run (default: gencorpus.exe)\n")
+           TEXT("Exit code 1 if any count differs from what gencorpus made.\n")
+           );
+    exit(EXIT_FAILURE);
+}
+
+int _tmain (int argc, TCHAR **argv)
+{
+    TCHAR CmdLine[1024];
+    char * Output;
+    int Dupes, LinkGroups;
+    int argn, a;
+
+    for (argn = 1; argn < argc - 1; argn++){
+        TCHAR * arg = argv[argn];
+        if (arg[0] != '-') break;
+        if (!_tcscmp(arg, TEXT("-exe"))){
+            ExeName = argv[++argn];
+        }else if (!_tcscmp(arg, TEXT("-gen"))){
+            GenOptions = argv[++argn];
+        }else if (!_tcscmp(arg, TEXT("-genexe"))){
+            GenName = argv[++argn];
+        }else{
+            Usage();
+        }
+    }
+    if (argn != argc - 1 || GenOptions == NULL) Usage();
+    TreeDir = argv[argn];
+
+    _sntprintf(CmdLine, 1024, TEXT("\"%s\" %s \"%s\""), GenName, GenOptions, TreeDir);
+    CmdLine[1023] = 0;
+    if (RunCapture(CmdLine, &Output) != 0){
+        _ftprintf(stderr, TEXT("'%s' failed\n"), CmdLine);
+        exit(EXIT_FAILURE);
+    }
+    Dupes = FindCount(Output, "Dupes:", NULL);
+    LinkGroups = FindCount(Output, "Link groups:", NULL);
+    free(Output);
+    if (Dupes < 0 || LinkGroups < 0){
+        _ftprintf(stderr, TEXT("No counts in the output of '%s'\n"), CmdLine);
+        exit(EXIT_FAILURE);
+    }
+    _tprintf(TEXT("%s: %d duplicates, %d hardlink groups\n"), TreeDir, Dupes, LinkGroups);
+
+    for (a = 0; a < NUM_REPORT_OPTIONS; a++){
+        Output = RunFinddupe(ReportOptions[a]);
+        Check(TEXT("dupes"), ReportOptions[a], FindCount(Output, "Dupes:", " in "), Dupes);
+        if (strstr(Output, "could not be opened") || strstr(Output, "read problem")
+                || strstr(Output, "full file read")){
+            _tprintf(TEXT("  FAILED  %-9s %-38s files could not be read\n"), TEXT("errors"), ReportOptions[a]);
+            Failures += 1;
+        }
+        free(Output);
+    }
+
+    Output = RunFinddupe(TEXT("-listlink"));
+    Check(TEXT("groups"), TEXT("-listlink"), FindCount(Output, "Number of hardlink groups found:", NULL), LinkGroups);
+    free(Output);
+
+    if (Failures){
+        _tprintf(TEXT("%d checks failed\n"), Failures);
+        return EXIT_FAILURE;
+    }
+    return EXIT_SUCCESS;
+}
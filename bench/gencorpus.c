@@ -0,0 +1,495 @@
+//--------------------------------------------------------------------------
+// gencorpus - generate a tree of test files for finddupe performance tests
+//
+// The same options and seed always give the same tree, so runs can be
+// compared.  File sizes are spread log-uniformly between -minsize and
+// -maxsize.  Some files take the size of an earlier file, some are copies of
+// an earlier file, some have the size and head of an earlier file but differ
+// behind it, and some are hardlinks to an earlier file.  Large files can be
+// written sparse, with only some blocks holding data, to save disk space.
+//
+// Version 1.35  Oct 2026
+//
+// This file is part of finddupe.
+//
+// finddupe is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//--------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#include <tchar.h>
+#include <ctype.h>
+#include <errno.h>
+#include <direct.h>
+#include <io.h>
+
+#define WIN32_LEAN_AND_MEAN
+#define _WIN32_WINNT 0x0500
+#include <windows.h>
+#include <winioctl.h>
+
+#define BLOCK_SIZE    (64 * 1024)           // Unit of generated data
+#define SPARSE_STRIDE (16 * 1024 * 1024)    // Sparse files hold a block every this many bytes
+#define MAX_DIRS      100000
+
+#define KIND_UNIQUE   0
+#define KIND_SAMESIZE 1   // Size of an earlier file, other content
+#define KIND_COPY     2   // Same content as an earlier file
+#define KIND_PREFIX   3   // Same size and head as an earlier file, differs behind
+#define KIND_LINK     4   // Hardlink to an earlier file
+
+typedef struct {
+    UINT64 Size;
+    UINT64 Seed;          // Content up to DiffAt
+    UINT64 DiffSeed;      // Content from DiffAt on
+    UINT64 DiffAt;
+    int Kind;
+    int LinkTo;           // For KIND_LINK
+    int ContentOf;        // First file with the same content
+    int Links;            // Hardlinks made to this file
+    int Dir;
+}FileSpec_t;
+
+static int NumFiles = 10000;
+static UINT64 MinSize = 1024;
+static UINT64 MaxSize = 16 * 1024 * 1024;
+static int SameSizePct = 20;
+static int DupePct = 10;
+static int PrefixPct = 5;
+static UINT64 PrefixLen = 1024 * 1024;
+static int LinkPct = 2;
+static int Depth = 3;
+static int Fanout = 4;
+static UINT64 SparseFrom = 0;       // 0: no sparse files
+static UINT64 RandState = 1;
+
+static FileSpec_t * Files;
+static TCHAR ** Dirs;
+static int NumDirs;
+
+//--------------------------------------------------------------------------
+// xorshift64*, the same sequence on every platform.
+//--------------------------------------------------------------------------
+static UINT64 NextRand(UINT64 * State)
+{
+    UINT64 x = *State;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *State = x;
+    return x * 0x2545F4914F6CDD1DULL;
+}
+
+static UINT64 Random(void)
+{
+    return NextRand(&RandState);
+}
+
+//--------------------------------------------------------------------------
+// Fill one block of the data stream of a seed.  Each block depends only on
+// the seed and its index, so any part of a file can be made on its own.
+//--------------------------------------------------------------------------
+static void FillBlock(UINT64 Seed, UINT64 Block, char * Buffer)
+{
+    UINT64 State = (Seed ^ (Block * 0x9E3779B97F4A7C15ULL)) | 1;
+    UINT64 * Words = (UINT64 *)Buffer;
+    int a;
+
+    NextRand(&State);
+    for (a = 0; a < BLOCK_SIZE / 8; a++) Words[a] = NextRand(&State);
+}
+
+//--------------------------------------------------------------------------
+// Content of one block of a file: the seed stream before DiffAt, the other
+// one from there on.
+//--------------------------------------------------------------------------
+static void FileBlock(const FileSpec_t * File, UINT64 Block, char * Buffer, char * Spare)
+{
+    UINT64 Start = Block * BLOCK_SIZE;
+
+    FillBlock(File->Seed, Block, Buffer);
+    if (File->DiffAt < Start + BLOCK_SIZE){
+        UINT64 From = File->DiffAt > Start ? File->DiffAt - Start : 0;
+        char Before = Buffer[From];
+        FillBlock(File->DiffSeed, Block, Spare);
+        memcpy(Buffer + From, Spare + From, (size_t)(BLOCK_SIZE - From));
+        if (File->DiffAt >= Start && Buffer[From] == Before){
+            Buffer[From] ^= 0x55; // Make sure the first byte differs.
+        }
+    }
+}
+
+//--------------------------------------------------------------------------
+// Blocks a sparse file holds data in: the head, the tail, the block where
+// it starts to differ, and one every SPARSE_STRIDE.  The rest reads as zeros.
+//--------------------------------------------------------------------------
+static int SparseBlock(const FileSpec_t * File, UINT64 Block)
+{
+    UINT64 Last = (File->Size - 1) / BLOCK_SIZE;
+    if (Block == 0 || Block == Last) return 1;
+    if (File->DiffAt < File->Size && Block == File->DiffAt / BLOCK_SIZE) return 1;
+    return (Block * BLOCK_SIZE) % SPARSE_STRIDE == 0;
+}
+
+static int IsSparse(const FileSpec_t * File)
+{
+    return SparseFrom && File->Size >= SparseFrom;
+}
+
+//--------------------------------------------------------------------------
+// Decide every file before writing any, so the tree only depends on the
+// options and the seed.
+//--------------------------------------------------------------------------
+static UINT64 RandomSize(void)
+{
+    // Log-uniform between MinSize and MaxSize.
+    double Lo = log((double)MinSize), Hi = log((double)MaxSize);
+    double r = (double)(Random() >> 11) / (double)(1ULL << 53);
+    UINT64 Size = (UINT64)exp(Lo + (Hi - Lo) * r);
+    if (Size < MinSize) Size = MinSize;
+    if (Size > MaxSize) Size = MaxSize;
+    return Size;
+}
+
+static int EarlierFile(int Before, int NotLinks)
+{
+    int a, Tries;
+    for (Tries = 0; Tries < 20; Tries++){
+        a = (int)(Random() % Before);
+        if (!NotLinks || Files[a].Kind != KIND_LINK) return a;
+    }
+    return -1;
+}
+
+static void PlanFiles(void)
+{
+    int a, Pick;
+
+    Files = (FileSpec_t *)calloc(NumFiles, sizeof(FileSpec_t));
+    if (Files == NULL){
+        _ftprintf(stderr, TEXT("Malloc failure\n"));
+        exit(EXIT_FAILURE);
+    }
+
+    for (a = 0; a < NumFiles; a++){
+        FileSpec_t * File = &Files[a];
+        int r = (int)(Random() % 100);
+
+        File->Dir = (int)(Random() % NumDirs);
+        File->Seed = Random();
+        File->DiffSeed = File->Seed;
+        File->Kind = KIND_UNIQUE;
+        File->ContentOf = a;
+        Pick = a ? EarlierFile(a, 1) : -1;
+
+        if (Pick >= 0 && r < LinkPct){
+            File->Kind = KIND_LINK;
+            File->LinkTo = Pick;
+            while (Files[File->LinkTo].Kind == KIND_LINK) File->LinkTo = Files[File->LinkTo].LinkTo;
+            File->Size = Files[File->LinkTo].Size;
+            File->ContentOf = Files[File->LinkTo].ContentOf;
+        }else if (Pick >= 0 && (r -= LinkPct) < DupePct){
+            File->Kind = KIND_COPY;
+            File->Size = Files[Pick].Size;
+            File->Seed = Files[Pick].Seed;
+            File->DiffSeed = Files[Pick].DiffSeed;
+            File->DiffAt = Files[Pick].DiffAt;
+            File->ContentOf = Files[Pick].ContentOf;
+            continue;
+        }else if (Pick >= 0 && (r -= DupePct) < PrefixPct && Files[Pick].Size > 1){
+            File->Kind = KIND_PREFIX;
+            File->Size = Files[Pick].Size;
+            File->Seed = Files[Pick].Seed;
+            File->DiffSeed = Random();
+            File->DiffAt = PrefixLen < File->Size ? PrefixLen : File->Size - 1;
+            if (Files[Pick].DiffAt < File->DiffAt) File->DiffAt = Files[Pick].DiffAt;
+            continue;
+        }else if (Pick >= 0 && (r -= PrefixPct) < SameSizePct){
+            File->Kind = KIND_SAMESIZE;
+            File->Size = Files[Pick].Size;
+        }else{
+            File->Size = RandomSize();
+        }
+        File->DiffAt = File->Size;
+    }
+}
+
+//--------------------------------------------------------------------------
+// Directories, level by level: dir, dir\d00, dir\d01, ... dir\d00\d00 ...
+//--------------------------------------------------------------------------
+static void PlanDirs(const TCHAR * Root)
+{
+    int Level, First, Last, a, c;
+
+    Dirs = (TCHAR **)malloc(MAX_DIRS * sizeof(TCHAR *));
+    if (Dirs == NULL){
+        _ftprintf(stderr, TEXT("Malloc failure\n"));
+        exit(EXIT_FAILURE);
+    }
+    Dirs[0] = _tcsdup(Root);
+    NumDirs = 1;
+
+    First = 0;
+    for (Level = 0; Level < Depth; Level++){
+        Last = NumDirs;
+        for (a = First; a < Last; a++){
+            for (c = 0; c < Fanout && NumDirs < MAX_DIRS; c++){
+                TCHAR Name[_MAX_PATH];
+                _sntprintf(Name, _MAX_PATH, TEXT("%s\\d%02d"), Dirs[a], c);
+                Name[_MAX_PATH-1] = '\0';
+                Dirs[NumDirs++] = _tcsdup(Name);
+            }
+        }
+        First = Last;
+    }
+}
+
+static void FileName(int a, TCHAR * Name)
+{
+    _sntprintf(Name, _MAX_PATH, TEXT("%s\\f%07d.dat"), Dirs[Files[a].Dir], a);
+    Name[_MAX_PATH-1] = '\0';
+}
+
+//--------------------------------------------------------------------------
+// The order finddupe lists the files of dir\** in: the files of a directory
+// by name, then its subdirectories by name.  Directory names all have the
+// same length, so that is the order of the directory paths, and then of the
+// file numbers.
+//--------------------------------------------------------------------------
+static int CompareListed(const void * a, const void * b)
+{
+    int A = *(const int *)a;
+    int B = *(const int *)b;
+    int comp = _tcscmp(Dirs[Files[A].Dir], Dirs[Files[B].Dir]);
+    if (comp) return comp;
+    return A - B;
+}
+
+//--------------------------------------------------------------------------
+// The duplicates finddupe should report.  Of the files with the same
+// content, it keeps the first one listed, and counts every other one that
+// is not a hardlink to that file.  A copy listed before its original, or a
+// hardlink to a copy, counts too.
+//--------------------------------------------------------------------------
+static int ExpectedDupes(void)
+{
+    int * Listed = (int *)malloc(NumFiles * sizeof(int));
+    int * Keeper = (int *)malloc(NumFiles * sizeof(int));
+    int a, Dupes = 0;
+
+    if (Listed == NULL || Keeper == NULL){
+        _ftprintf(stderr, TEXT("Malloc failure\n"));
+        exit(EXIT_FAILURE);
+    }
+    for (a = 0; a < NumFiles; a++){
+        Listed[a] = a;
+        Keeper[a] = -1;
+    }
+    qsort(Listed, NumFiles, sizeof(int), CompareListed);
+
+    for (a = 0; a < NumFiles; a++){
+        FileSpec_t * File = &Files[Listed[a]];
+        int Physical = File->Kind == KIND_LINK ? File->LinkTo : Listed[a];
+        if (Keeper[File->ContentOf] < 0){
+            Keeper[File->ContentOf] = Physical;
+        }else if (Keeper[File->ContentOf] != Physical){
+            Dupes += 1;
+        }
+    }
+    free(Listed);
+    free(Keeper);
+    return Dupes;
+}
+
+//--------------------------------------------------------------------------
+// Write one file.  Returns the bytes that hold data.
+//--------------------------------------------------------------------------
+static UINT64 WriteFileData(int a, char * Buffer, char * Spare)
+{
+    FileSpec_t * File = &Files[a];
+    TCHAR Name[_MAX_PATH];
+    HANDLE FileHandle;
+    UINT64 Block, NumBlocks, Written = 0;
+    LARGE_INTEGER Pos;
+    DWORD Bytes, Length;
+    int Sparse = IsSparse(File);
+
+    FileName(a, Name);
+    _tunlink(Name); // Could be hardlinked to another file by finddupe -hardlink
+    FileHandle = CreateFile(Name, GENERIC_WRITE, 0, NULL, CREATE_ALWAYS, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (FileHandle == INVALID_HANDLE_VALUE){
+        _ftprintf(stderr, TEXT("Could not create '%s'\n"), Name);
+        exit(EXIT_FAILURE);
+    }
+    if (Sparse && !DeviceIoControl(FileHandle, FSCTL_SET_SPARSE, NULL, 0, NULL, 0, &Bytes, NULL)){
+        Sparse = 0; // File system without sparse files, write it all.
+    }
+
+    NumBlocks = (File->Size + BLOCK_SIZE - 1) / BLOCK_SIZE;
+    for (Block = 0; Block < NumBlocks; Block++){
+        if (Sparse){
+            if (!SparseBlock(File, Block)) continue;
+            Pos.QuadPart = Block * BLOCK_SIZE;
+            SetFilePointerEx(FileHandle, Pos, NULL, FILE_BEGIN);
+        }
+        FileBlock(File, Block, Buffer, Spare);
+        Length = BLOCK_SIZE;
+        if (Block == NumBlocks - 1) Length = (DWORD)(File->Size - Block * BLOCK_SIZE);
+        if (!WriteFile(FileHandle, Buffer, Length, &Bytes, NULL) || Bytes != Length){
+            _ftprintf(stderr, TEXT("Write to '%s' failed\n"), Name);
+            exit(EXIT_FAILURE);
+        }
+        Written += Length;
+    }
+    if (Sparse){
+        Pos.QuadPart = File->Size;
+        SetFilePointerEx(FileHandle, Pos, NULL, FILE_BEGIN);
+        SetEndOfFile(FileHandle);
+    }
+    CloseHandle(FileHandle);
+    return Written;
+}
+
+static UINT64 ParseSize(const TCHAR * Str)
+{
+    TCHAR * End;
+    UINT64 Size = _tcstoui64(Str, &End, 10);
+    switch (tolower(*End)){
+        case 'k': Size <<= 10; break;
+        case 'm': Size <<= 20; break;
+        case 'g': Size <<= 30; break;
+    }
+    return Size;
+}
+
+static void Usage (void)
+{
+    _tprintf(TEXT("gencorpus - generate a tree of test files for finddupe\n\n"));
+    _tprintf(TEXT("Usage: gencorpus [options] <dir>\n"));
+    _tprintf(TEXT("Options:\n")
+           TEXT(" -files <n>       Number of files (default: 10000)\n")
+           TEXT(" -minsize <size>  Smallest file size, k, m or g suffix allowed (default: 1k)\n")
+           TEXT(" -maxsize <size>  Largest file size, sizes are spread log-uniformly in between\n")
+           TEXT("                  (default: 16m)\n")
+           TEXT(" -samesize <pct>  Percent of files with the size of an earlier file but other\n")
+           TEXT("                  content (default: 20)\n")
+           TEXT(" -dupes <pct>     Percent of files that are copies of an earlier file (default: 10)\n")
+           TEXT(" -prefix <pct>    Percent of files with the size and head of an earlier file\n")
+           TEXT("                  that differ behind the head (default: 5)\n")
+           TEXT(" -prefixlen <size> Length of that head, shorter files differ in their last byte\n")
+           TEXT("                  (default: 1m)\n")
+           TEXT(" -links <pct>     Percent of files that are hardlinks to an earlier file\n")
+           TEXT("                  (default: 2)\n")
+           TEXT(" -depth <n>       Directory levels below dir (default: 3)\n")
+           TEXT(" -fanout <n>      Subdirectories per directory (default: 4)\n")
+           TEXT(" -sparse <size>   Write files of this size and up as sparse files that hold data\n")
+           TEXT("                  in the head, the tail and every 16 MB (default: off)\n")
+           TEXT(" -seed <n>        Same seed and options give the same tree (default: 1)\n")
+           );
+    exit(EXIT_FAILURE);
+}
+
+int _tmain (int argc, TCHAR **argv)
+{
+    int argn, a;
+    int Counts[5] = {0};
+    int LinkGroups = 0;
+    UINT64 TotalBytes = 0, DataBytes = 0;
+    char * Buffer, * Spare;
+
+    for (argn = 1; argn < argc - 1; argn++){
+        TCHAR * arg = argv[argn];
+        if (arg[0] != '-') break;
+        if (!_tcscmp(arg, TEXT("-files"))){
+            NumFiles = _ttoi(argv[++argn]);
+        }else if (!_tcscmp(arg, TEXT("-minsize"))){
+            MinSize = ParseSize(argv[++argn]);
+        }else if (!_tcscmp(arg, TEXT("-maxsize"))){
+            MaxSize = ParseSize(argv[++argn]);
+        }else if (!_tcscmp(arg, TEXT("-samesize"))){
+            SameSizePct = _ttoi(argv[++argn]);
+        }else if (!_tcscmp(arg, TEXT("-dupes"))){
+            DupePct = _ttoi(argv[++argn]);
+        }else if (!_tcscmp(arg, TEXT("-prefix"))){
+            PrefixPct = _ttoi(argv[++argn]);
+        }else if (!_tcscmp(arg, TEXT("-prefixlen"))){
+            PrefixLen = ParseSize(argv[++argn]);
+        }else if (!_tcscmp(arg, TEXT("-links"))){
+            LinkPct = _ttoi(argv[++argn]);
+        }else if (!_tcscmp(arg, TEXT("-depth"))){
+            Depth = _ttoi(argv[++argn]);
+        }else if (!_tcscmp(arg, TEXT("-fanout"))){
+            Fanout = _ttoi(argv[++argn]);
+        }else if (!_tcscmp(arg, TEXT("-sparse"))){
+            SparseFrom = ParseSize(argv[++argn]);
+        }else if (!_tcscmp(arg, TEXT("-seed"))){
+            RandState = _tcstoui64(argv[++argn], NULL, 10) * 2 + 1; // Never 0.
+        }else{
+            Usage();
+        }
+    }
+    if (argn != argc - 1 || NumFiles < 1 || MinSize < 1 || MaxSize < MinSize) Usage();
+
+    PlanDirs(argv[argn]);
+    PlanFiles();
+
+    for (a = 0; a < NumDirs; a++){
+        if (_tmkdir(Dirs[a]) != 0 && errno != EEXIST){
+            _ftprintf(stderr, TEXT("Could not create directory '%s'\n"), Dirs[a]);
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    Buffer = (char *)malloc(BLOCK_SIZE);
+    Spare = (char *)malloc(BLOCK_SIZE);
+    if (Buffer == NULL || Spare == NULL){
+        _ftprintf(stderr, TEXT("Malloc failure\n"));
+        exit(EXIT_FAILURE);
+    }
+
+    for (a = 0; a < NumFiles; a++){
+        FileSpec_t * File = &Files[a];
+        Counts[File->Kind] += 1;
+        TotalBytes += File->Size;
+        if (File->Kind == KIND_LINK){
+            TCHAR Name[_MAX_PATH], Target[_MAX_PATH];
+            FileName(a, Name);
+            FileName(File->LinkTo, Target);
+            _tunlink(Name);
+            if (!CreateHardLink(Name, Target, NULL)){
+                _ftprintf(stderr, TEXT("Could not link '%s' to '%s'\n"), Name, Target);
+                exit(EXIT_FAILURE);
+            }
+            if (Files[File->LinkTo].Links++ == 0) LinkGroups += 1;
+            continue;
+        }
+        DataBytes += WriteFileData(a, Buffer, Spare);
+        if ((a & 255) == 0){
+            _tprintf(TEXT("Writing file %d of %d\r"), a, NumFiles);
+            fflush(stdout);
+        }
+    }
+
+    _tprintf(TEXT("Files:       %d in %d directories, %llu MB (%llu MB of data written)\n"),
+        NumFiles, NumDirs, TotalBytes >> 20, DataBytes >> 20);
+    _tprintf(TEXT("Unique:      %d\n"), Counts[KIND_UNIQUE]);
+    _tprintf(TEXT("Same size:   %d\n"), Counts[KIND_SAMESIZE]);
+    _tprintf(TEXT("Copies:      %d\n"), Counts[KIND_COPY]);
+    _tprintf(TEXT("Same head:   %d\n"), Counts[KIND_PREFIX]);
+    _tprintf(TEXT("Hardlinks:   %d\n"), Counts[KIND_LINK]);
+    _tprintf(TEXT("Link groups: %d (hardlink groups finddupe -listlink should report)\n"), LinkGroups);
+    _tprintf(TEXT("Dupes:       %d (duplicates finddupe should report)\n"), ExpectedDupes());
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,397 @@
+//--------------------------------------------------------------------------
+// microbench - time finddupe's hot kernels in isolation
+//
+// Includes finddupe.c and myglob.c, so the kernels measured are the static
+// functions finddupe itself uses, compiled with the same options.  Each
+// benchmark is repeated until it runs at least -time milliseconds, and the
+// best of three such runs is reported, in ns per operation and, where an
+// operation has a size, GB/s.
+//
+// Version 1.35  Oct 2026
+//
+// This file is part of finddupe.
+//
+// finddupe is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//--------------------------------------------------------------------------
+#include <tchar.h>
+
+#define FINDDUPE_LIB        // Without finddupe's own main
+#include "../finddupe.c"
+#include "../myglob.c"
+
+#define NUM_VARIANTS 64     // Inputs cycled through, so no result can be hoisted out of a loop
+
+// A benchmark runs its operation Reps times and returns the number of
+// operations done (more than Reps if one repetition does several).
+typedef UINT64 (*BenchFunc_t)(void * Arg, int Reps);
+
+static int MinMs = 200;             // Each measurement runs at least this long
+static const TCHAR * Only;          // Only run benchmarks with this in their name
+static LONGLONG Frequency;
+static UINT64 RandState = 1;
+static volatile unsigned Sink;      // Results go here so they are not optimized away
+
+static UINT64 NextRand(void)
+{
+    RandState ^= RandState >> 12;
+    RandState ^= RandState << 25;
+    RandState ^= RandState >> 27;
+    return RandState * 2685821657736338717ULL;
+}
+
+static void * MallocOrDie(size_t Size)
+{
+    void * Mem = malloc(Size);
+    if (Mem == NULL){
+        _ftprintf(stderr, TEXT("Malloc failure\n"));
+        exit(EXIT_FAILURE);
+    }
+    return Mem;
+}
+
+static double TimeReps(BenchFunc_t Func, void * Arg, int Reps, UINT64 * Ops)
+{
+    LARGE_INTEGER Start, End;
+    QueryPerformanceCounter(&Start);
+    *Ops = Func(Arg, Reps);
+    QueryPerformanceCounter(&End);
+    return (double)(End.QuadPart - Start.QuadPart) * 1e9 / Frequency;
+}
+
+static int Wanted(const TCHAR * Name)
+{
+    return Only == NULL || _tcsstr(Name, Only) != NULL;
+}
+
+//--------------------------------------------------------------------------
+// Time Func and print one result line.  Bytes is the input size of one
+// operation, 0 if throughput makes no sense for it.
+//--------------------------------------------------------------------------
+static void RunBench(const TCHAR * Name, const TCHAR * Size, BenchFunc_t Func, void * Arg, UINT64 Bytes)
+{
+    int Reps = 1;
+    int Round;
+    UINT64 Ops;
+    double Ns, Best;
+
+    if (!Wanted(Name)) return;
+
+    // Double the repetitions until one run takes long enough.
+    for (;;){
+        Ns = TimeReps(Func, Arg, Reps, &Ops);
+        if (Ns >= MinMs * 1e6 || Reps >= (1 << 30)) break;
+        Reps *= 2;
+    }
+    Best = Ns / Ops;
+    for (Round = 0; Round < 2; Round++){
+        Ns = TimeReps(Func, Arg, Reps, &Ops) / Ops;
+        if (Ns < Best) Best = Ns;
+    }
+
+    if (Bytes){
+        _tprintf(TEXT("%-18s %8s %12.1f %9.2f\n"), Name, Size, Best, Bytes / Best);
+    }else{
+        _tprintf(TEXT("%-18s %8s %12.1f %9s\n"), Name, Size, Best, TEXT("-"));
+    }
+    fflush(stdout);
+}
+
+static const TCHAR * SizeName(UINT64 Size, TCHAR Buf[20])
+{
+    if (Size >= 1024*1024 && Size % (1024*1024) == 0){
+        _sntprintf(Buf, 20, TEXT("%lluM"), Size >> 20);
+    }else if (Size >= 1024 && Size % 1024 == 0){
+        _sntprintf(Buf, 20, TEXT("%lluK"), Size >> 10);
+    }else{
+        _sntprintf(Buf, 20, TEXT("%llu"), Size);
+    }
+    return Buf;
+}
+
+//--------------------------------------------------------------------------
+// CalcCrc over one buffer of each size, the checksum carried from one
+// call to the next.
+//--------------------------------------------------------------------------
+typedef struct {
+    char * Data;
+    unsigned Len;
+}CrcArg_t;
+
+static UINT64 BenchCrc(void * Arg, int Reps)
+{
+    CrcArg_t * A = (CrcArg_t *)Arg;
+    Checksum_t Check = {0, 0};
+    int r;
+    for (r = 0; r < Reps; r++){
+        CalcCrc(&Check, A->Data, A->Len);
+    }
+    Sink += Check.Crc ^ Check.Sum;
+    return Reps;
+}
+
+//--------------------------------------------------------------------------
+// TStrHash of paths of one length.
+//--------------------------------------------------------------------------
+typedef struct {
+    TCHAR * Paths[NUM_VARIANTS];
+}HashArg_t;
+
+static UINT64 BenchPathHash(void * Arg, int Reps)
+{
+    HashArg_t * A = (HashArg_t *)Arg;
+    khint_t h = 0;
+    int r;
+    for (r = 0; r < Reps; r++){
+        h += TStrHash(A->Paths[r & (NUM_VARIANTS-1)]);
+    }
+    Sink += h;
+    return Reps;
+}
+
+//--------------------------------------------------------------------------
+// Path set (pathset) and size map (hmap) with N keys: building the table
+// from empty, and lookups of keys that are in it and keys that are not.
+//--------------------------------------------------------------------------
+typedef struct {
+    int N;
+    PathKey_t * Keys;       // N keys in the table, then N that are not
+    UINT64 * Sizes;         // Same for the size map
+    khash_t(pathset) * Set;
+    khash_t(hmap) * Map;
+}MapArg_t;
+
+static UINT64 BenchPathsetPut(void * Arg, int Reps)
+{
+    MapArg_t * A = (MapArg_t *)Arg;
+    int r, a, ret;
+    for (r = 0; r < Reps; r++){
+        khash_t(pathset) * Set = kh_init(pathset);
+        for (a = 0; a < A->N; a++){
+            kh_put(pathset, Set, A->Keys[a], &ret);
+        }
+        Sink += kh_size(Set);
+        kh_destroy(pathset, Set);
+    }
+    return (UINT64)Reps * A->N;
+}
+
+static UINT64 LookupPaths(MapArg_t * A, int Reps, int Miss)
+{
+    int r;
+    int a = 0;
+    unsigned Found = 0;
+    PathKey_t * Keys = A->Keys + (Miss ? A->N : 0);
+    for (r = 0; r < Reps; r++){
+        Found += kh_get(pathset, A->Set, Keys[a]) != kh_end(A->Set);
+        if (++a == A->N) a = 0;
+    }
+    Sink += Found;
+    return Reps;
+}
+static UINT64 BenchPathsetHit(void * Arg, int Reps) { return LookupPaths((MapArg_t *)Arg, Reps, 0); }
+static UINT64 BenchPathsetMiss(void * Arg, int Reps) { return LookupPaths((MapArg_t *)Arg, Reps, 1); }
+
+static UINT64 BenchHmapPut(void * Arg, int Reps)
+{
+    MapArg_t * A = (MapArg_t *)Arg;
+    int r, a, ret;
+    for (r = 0; r < Reps; r++){
+        khash_t(hmap) * Map = kh_init(hmap);
+        for (a = 0; a < A->N; a++){
+            khint_t k = kh_put(hmap, Map, A->Sizes[a], &ret);
+            kh_value(Map, k).Count = 0;
+        }
+        Sink += kh_size(Map);
+        kh_destroy(hmap, Map);
+    }
+    return (UINT64)Reps * A->N;
+}
+
+static UINT64 LookupSizes(MapArg_t * A, int Reps, int Miss)
+{
+    int r;
+    int a = 0;
+    unsigned Found = 0;
+    UINT64 * Sizes = A->Sizes + (Miss ? A->N : 0);
+    for (r = 0; r < Reps; r++){
+        Found += kh_get(hmap, A->Map, Sizes[a]) != kh_end(A->Map);
+        if (++a == A->N) a = 0;
+    }
+    Sink += Found;
+    return Reps;
+}
+static UINT64 BenchHmapHit(void * Arg, int Reps) { return LookupSizes((MapArg_t *)Arg, Reps, 0); }
+static UINT64 BenchHmapMiss(void * Arg, int Reps) { return LookupSizes((MapArg_t *)Arg, Reps, 1); }
+
+static const struct {
+    const TCHAR * Name;
+    BenchFunc_t Func;
+}MapBenches[] = {
+    {TEXT("pathset put"),      BenchPathsetPut},
+    {TEXT("pathset get hit"),  BenchPathsetHit},
+    {TEXT("pathset get miss"), BenchPathsetMiss},
+    {TEXT("hmap put"),         BenchHmapPut},
+    {TEXT("hmap get hit"),     BenchHmapHit},
+    {TEXT("hmap get miss"),    BenchHmapMiss},
+};
+#define NUM_MAP_BENCHES (int)(sizeof(MapBenches) / sizeof(MapBenches[0]))
+
+//--------------------------------------------------------------------------
+// Keys as finddupe sees them: paths in a directory tree, and file sizes
+// spread log-uniformly from 1 byte to 4 GB.
+//--------------------------------------------------------------------------
+static void MakeKeys(MapArg_t * A, int N)
+{
+    int a, ret;
+    khint_t k;
+    A->N = N;
+    A->Keys = (PathKey_t *)MallocOrDie(sizeof(PathKey_t) * 2 * N);
+    A->Sizes = (UINT64 *)MallocOrDie(sizeof(UINT64) * 2 * N);
+    for (a = 0; a < 2 * N; a++){
+        TCHAR Name[_MAX_PATH];
+        unsigned Dir = (unsigned)(NextRand() % 4096);
+        _sntprintf(Name, _MAX_PATH, TEXT("d:\\corpus\\d%02u\\d%02u\\d%02u\\file%08d.dat"),
+            Dir >> 8, (Dir >> 4) & 15, Dir & 15, a);
+        A->Keys[a].Name = _tcsdup(Name);
+        A->Keys[a].Hash = TStrHash(Name);
+        // Sizes in the second half must not be in the first.
+        A->Sizes[a] = ((NextRand() & ((1ULL << (NextRand() % 32 + 1)) - 1)) << 1) | (a >= N);
+    }
+
+    A->Set = kh_init(pathset);
+    A->Map = kh_init(hmap);
+    for (a = 0; a < N; a++){
+        kh_put(pathset, A->Set, A->Keys[a], &ret);
+        k = kh_put(hmap, A->Map, A->Sizes[a], &ret);
+        kh_value(A->Map, k).Count = 0;
+    }
+}
+
+static void FreeKeys(MapArg_t * A)
+{
+    int a;
+    for (a = 0; a < 2 * A->N; a++) free((void *)A->Keys[a].Name);
+    free(A->Keys);
+    free(A->Sizes);
+    kh_destroy(pathset, A->Set);
+    kh_destroy(hmap, A->Map);
+}
+
+//--------------------------------------------------------------------------
+// SplitPattern on a copy of each pattern (it edits the pattern in place,
+// the copy is part of the time).
+//--------------------------------------------------------------------------
+static const TCHAR * Patterns[] = {
+    TEXT("c:\\photos\\*.jpg"),
+    TEXT("c:\\**\\*.c"),
+    TEXT("d:\\data\\projects\\2026\\**\\build\\*.obj"),
+    TEXT("\\\\server\\share\\archive\\backups\\2025\\october\\week42\\monday\\images\\raw\\*"),
+};
+
+static UINT64 BenchSplit(void * Arg, int Reps)
+{
+    const TCHAR * Pattern = (const TCHAR *)Arg;
+    TCHAR PatCopy[_MAX_PATH*2];
+    int BaseEnd, PatternEnd, StarStarAt;
+    int r;
+    unsigned Total = 0;
+    for (r = 0; r < Reps; r++){
+        _tcscpy(PatCopy, Pattern);
+        Total += SplitPattern(PatCopy, &BaseEnd, &PatternEnd, &StarStarAt) + BaseEnd + PatternEnd;
+    }
+    Sink += Total;
+    return Reps;
+}
+
+static void BenchUsage (void)
+{
+    _tprintf(TEXT("microbench - time finddupe's hot kernels in isolation\n\n"));
+    _tprintf(TEXT("Usage: microbench [-time <ms>] [name]\n"));
+    _tprintf(TEXT("Options:\n")
+           TEXT(" -time <ms>   Run each measurement at least this long (default: 200)\n")
+           TEXT(" name         Only run benchmarks with this in their name (eg. crc, pathset)\n")
+           );
+    exit(EXIT_FAILURE);
+}
+
+int _tmain (int argc, TCHAR **argv)
+{
+    static const unsigned CrcSizes[] = {64, 4096, 65536, 1024*1024, 16*1024*1024};
+    static const int PathLengths[] = {16, 64, 256};
+    static const int MapSizes[] = {1000, 100000, 1000000};
+    LARGE_INTEGER Freq;
+    TCHAR Buf[20];
+    int argn, a, v;
+
+    for (argn = 1; argn < argc; argn++){
+        TCHAR * arg = argv[argn];
+        if (!_tcscmp(arg, TEXT("-time")) && argn < argc - 1){
+            MinMs = _ttoi(argv[++argn]);
+        }else if (arg[0] != '-' && Only == NULL){
+            Only = arg;
+        }else{
+            BenchUsage();
+        }
+    }
+    if (MinMs < 1) BenchUsage();
+
+    QueryPerformanceFrequency(&Freq);
+    Frequency = Freq.QuadPart;
+
+    _tprintf(TEXT("%-18s %8s %12s %9s\n"), TEXT("Benchmark"), TEXT("Size"), TEXT("ns/op"), TEXT("GB/s"));
+
+    {
+        CrcArg_t Arg;
+        Arg.Data = (char *)MallocOrDie(CrcSizes[4]);
+        for (a = 0; a < (int)CrcSizes[4]; a++) Arg.Data[a] = (char)NextRand();
+        for (a = 0; a < 5; a++){
+            Arg.Len = CrcSizes[a];
+            RunBench(TEXT("crc"), SizeName(Arg.Len, Buf), BenchCrc, &Arg, Arg.Len);
+        }
+        free(Arg.Data);
+    }
+
+    for (a = 0; a < 3; a++){
+        HashArg_t Arg;
+        int Len = PathLengths[a];
+        for (v = 0; v < NUM_VARIANTS; v++){
+            int c;
+            Arg.Paths[v] = (TCHAR *)MallocOrDie((Len + 1) * sizeof(TCHAR));
+            for (c = 0; c < Len; c++) Arg.Paths[v][c] = (TCHAR)('a' + NextRand() % 26);
+            Arg.Paths[v][Len] = 0;
+        }
+        RunBench(TEXT("pathhash"), SizeName(Len, Buf), BenchPathHash, &Arg, Len * sizeof(TCHAR));
+        for (v = 0; v < NUM_VARIANTS; v++) free(Arg.Paths[v]);
+    }
+
+    for (a = 0; a < 3; a++){
+        MapArg_t Arg;
+        for (v = 0; v < NUM_MAP_BENCHES; v++){
+            if (Wanted(MapBenches[v].Name)) break;
+        }
+        if (v == NUM_MAP_BENCHES) break; // Skip building the keys.
+        MakeKeys(&Arg, MapSizes[a]);
+        SizeName(Arg.N, Buf);
+        for (v = 0; v < NUM_MAP_BENCHES; v++){
+            RunBench(MapBenches[v].Name, Buf, MapBenches[v].Func, &Arg, 0);
+        }
+        FreeKeys(&Arg);
+    }
+
+    for (a = 0; a < (int)(sizeof(Patterns) / sizeof(Patterns[0])); a++){
+        int Len = _tcslen(Patterns[a]);
+        RunBench(TEXT("split pattern"), SizeName(Len, Buf), BenchSplit, (void *)Patterns[a], Len * sizeof(TCHAR));
+    }
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,472 @@
+//--------------------------------------------------------------------------
+// runbench - run finddupe end to end on a test tree and record the cost
+//
+// Runs finddupe in each mode (report, -listlink, -hardlink, -bat, -sigs) on
+// a warm and on a cold file cache, a number of times each.  Of the run with
+// the median wall time it records wall time, files per second, CPU time,
+// the I/O calls and bytes of the process (GetProcessIoCounters) and the
+// peak working set, as one JSON object per line.  Given a baseline written
+// by an earlier run, it shows the change of each measure and flags the ones
+// that got worse by more than the threshold.  If the baseline file does not
+// exist yet, this run's results are recorded in it instead.
+//
+// Windows has no call to empty the file cache.  For a cold run, every file
+// of the tree is opened once without buffering first, which makes the
+// cache manager drop its cached data.  Directory data stays cached.
+//
+// Version 1.35  Oct 2026
+//
+// This file is part of finddupe.
+//
+// finddupe is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//--------------------------------------------------------------------------
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <tchar.h>
+
+#define WIN32_LEAN_AND_MEAN
+#define _WIN32_WINNT 0x0500
+#include <windows.h>
+#include <psapi.h> /* GetProcessMemoryInfo */
+#pragma comment(lib, "psapi.lib")
+
+#define MAX_RUNS      99
+#define MAX_BASELINE  256       // Lines read from the baseline file
+
+typedef struct {
+    const TCHAR * Name;
+    const TCHAR * Args;         // Options given to finddupe
+    int Changes;                // Changes the tree, which is rebuilt after each run
+}Mode_t;
+
+static const Mode_t Modes[] = {
+    {TEXT("report"),   TEXT(""),          0},
+    {TEXT("listlink"), TEXT("-listlink"), 0},
+    {TEXT("hardlink"), TEXT("-hardlink"), 1},
+    {TEXT("bat"),      TEXT("-bat"),      0},   // Batch file goes to the temp directory
+    {TEXT("sigs"),     TEXT("-sigs"),     0},
+};
+#define NUM_MODES (int)(sizeof(Modes) / sizeof(Modes[0]))
+
+typedef struct {
+    double WallSec;
+    double UserSec;
+    double KernelSec;
+    UINT64 ReadOps;
+    UINT64 ReadBytes;
+    UINT64 WriteOps;
+    UINT64 WriteBytes;
+    UINT64 OtherOps;            // I/O calls other than reads and writes
+    UINT64 PeakRss;             // Peak working set
+}RunStats_t;
+
+static const TCHAR * ExeName = TEXT("finddupe.exe");
+static const TCHAR * GenName = TEXT("gencorpus.exe");
+static const TCHAR * GenOptions;    // Options to rebuild the tree with, NULL if not given
+static const TCHAR * ModeList = TEXT("report,listlink,hardlink,bat,sigs");
+static const TCHAR * CacheList = TEXT("warm,cold");
+static const TCHAR * Label = TEXT("");
+static const TCHAR * OutName;
+static const TCHAR * BaselineName;
+static double Threshold = 10;       // Percent worse that counts as a regression
+static int NumRuns = 3;
+static const TCHAR * TreeDir;
+static TCHAR BatName[MAX_PATH];
+static UINT64 TreeFiles;
+static UINT64 TreeBytes;
+static LONGLONG Frequency;
+
+static TCHAR * Baseline[MAX_BASELINE];
+static int NumBaseline;
+static int Regressions;
+
+//--------------------------------------------------------------------------
+// Is Name one of the comma separated names in List
+//--------------------------------------------------------------------------
+static int InList(const TCHAR * List, const TCHAR * Name)
+{
+    size_t Len = _tcslen(Name);
+    while (*List){
+        if (!_tcsncmp(List, Name, Len) && (List[Len] == ',' || List[Len] == '\0')) return TRUE;
+        List = _tcschr(List, ',');
+        if (List == NULL) break;
+        List++;
+    }
+    return FALSE;
+}
+
+static double FileTimeSec(FILETIME Time)
+{
+    return (((UINT64)Time.dwHighDateTime << 32) | Time.dwLowDateTime) / 1e7;
+}
+
+//--------------------------------------------------------------------------
+// Run a command with its output going to NUL, and return its exit code.
+// If Stats is given, the cost of the process goes there.
+//--------------------------------------------------------------------------
+static DWORD RunCommand(TCHAR * CmdLine, RunStats_t * Stats)
+{
+    STARTUPINFO Startup;
+    PROCESS_INFORMATION Proc;
+    SECURITY_ATTRIBUTES Inherit;
+    HANDLE Nul;
+    LARGE_INTEGER Start, End;
+    DWORD ExitCode;
+
+    Inherit.nLength = sizeof(Inherit);
+    Inherit.lpSecurityDescriptor = NULL;
+    Inherit.bInheritHandle = TRUE;
+    Nul = CreateFile(TEXT("NUL"), GENERIC_WRITE, FILE_SHARE_READ | FILE_SHARE_WRITE,
+                     &Inherit, OPEN_EXISTING, 0, NULL);
+
+    memset(&Startup, 0, sizeof(Startup));
+    Startup.cb = sizeof(Startup);
+    Startup.dwFlags = STARTF_USESTDHANDLES;
+    Startup.hStdInput = GetStdHandle(STD_INPUT_HANDLE);
+    Startup.hStdOutput = Nul;
+    Startup.hStdError = GetStdHandle(STD_ERROR_HANDLE);
+
+    QueryPerformanceCounter(&Start);
+    if (!CreateProcess(NULL, CmdLine, NULL, NULL, TRUE, 0, NULL, NULL, &Startup, &Proc)){
+        _ftprintf(stderr, TEXT("Could not run '%s' (error %lu)\n"), CmdLine, GetLastError());
+        exit(EXIT_FAILURE);
+    }
+    WaitForSingleObject(Proc.hProcess, INFINITE);
+    QueryPerformanceCounter(&End);
+    CloseHandle(Nul);
+
+    if (Stats){
+        IO_COUNTERS Io;
+        PROCESS_MEMORY_COUNTERS Mem;
+        FILETIME Created, Exited, Kernel, User;
+
+        memset(Stats, 0, sizeof(RunStats_t));
+        Stats->WallSec = (double)(End.QuadPart - Start.QuadPart) / Frequency;
+        if (GetProcessTimes(Proc.hProcess, &Created, &Exited, &Kernel, &User)){
+            Stats->UserSec = FileTimeSec(User);
+            Stats->KernelSec = FileTimeSec(Kernel);
+        }
+        if (GetProcessIoCounters(Proc.hProcess, &Io)){
+            Stats->ReadOps = Io.ReadOperationCount;
+            Stats->ReadBytes = Io.ReadTransferCount;
+            Stats->WriteOps = Io.WriteOperationCount;
+            Stats->WriteBytes = Io.WriteTransferCount;
+            Stats->OtherOps = Io.OtherOperationCount;
+        }
+        if (GetProcessMemoryInfo(Proc.hProcess, &Mem, sizeof(Mem))){
+            Stats->PeakRss = Mem.PeakWorkingSetSize;
+        }
+    }
+
+    GetExitCodeProcess(Proc.hProcess, &ExitCode);
+    CloseHandle(Proc.hThread);
+    CloseHandle(Proc.hProcess);
+    return ExitCode;
+}
+
+//--------------------------------------------------------------------------
+// Count the files and bytes of the tree, or with Evict, open each file
+// once without buffering to push its data out of the file cache.
+//--------------------------------------------------------------------------
+static void WalkTree(const TCHAR * Dir, int Evict)
+{
+    TCHAR Pattern[MAX_PATH];
+    WIN32_FIND_DATA Found;
+    HANDLE Find;
+
+    _sntprintf(Pattern, MAX_PATH, TEXT("%s\\*"), Dir);
+    Pattern[MAX_PATH-1] = 0;
+    Find = FindFirstFile(Pattern, &Found);
+    if (Find == INVALID_HANDLE_VALUE) return;
+    do{
+        TCHAR Path[MAX_PATH];
+        if (!_tcscmp(Found.cFileName, TEXT(".")) || !_tcscmp(Found.cFileName, TEXT(".."))) continue;
+        if (Found.dwFileAttributes & FILE_ATTRIBUTE_REPARSE_POINT) continue;
+        _sntprintf(Path, MAX_PATH, TEXT("%s\\%s"), Dir, Found.cFileName);
+        Path[MAX_PATH-1] = 0;
+        if (Found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY){
+            WalkTree(Path, Evict);
+        }else if (Evict){
+            HANDLE File = CreateFile(Path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                     NULL, OPEN_EXISTING, FILE_FLAG_NO_BUFFERING, NULL);
+            if (File != INVALID_HANDLE_VALUE) CloseHandle(File);
+        }else{
+            TreeFiles += 1;
+            TreeBytes += ((UINT64)Found.nFileSizeHigh << 32) | Found.nFileSizeLow;
+        }
+    }while (FindNextFile(Find, &Found));
+    FindClose(Find);
+}
+
+//--------------------------------------------------------------------------
+// Write the tree again with gencorpus, which gives the same tree for the
+// same options.
+//--------------------------------------------------------------------------
+static void BuildTree(void)
+{
+    TCHAR CmdLine[1024];
+    _sntprintf(CmdLine, 1024, TEXT("\"%s\" %s \"%s\""), GenName, GenOptions, TreeDir);
+    CmdLine[1023] = 0;
+    if (RunCommand(CmdLine, NULL) != 0){
+        _ftprintf(stderr, TEXT("'%s' failed\n"), CmdLine);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static void RunFinddupe(const Mode_t * Mode, RunStats_t * Stats)
+{
+    TCHAR Args[MAX_PATH + 20];
+    TCHAR CmdLine[1024];
+    DWORD ExitCode;
+
+    if (!_tcscmp(Mode->Args, TEXT("-bat"))){
+        _sntprintf(Args, MAX_PATH + 20, TEXT("-bat \"%s\""), BatName);
+    }else{
+        _tcscpy(Args, Mode->Args);
+    }
+    _sntprintf(CmdLine, 1024, TEXT("\"%s\" -p %s \"%s\\**\""), ExeName, Args, TreeDir);
+    CmdLine[1023] = 0;
+    ExitCode = RunCommand(CmdLine, Stats);
+    if (ExitCode != 0){
+        _ftprintf(stderr, TEXT("'%s' failed with exit code %lu\n"), CmdLine, ExitCode);
+        exit(EXIT_FAILURE);
+    }
+}
+
+static int CompareWall(const void * a, const void * b)
+{
+    double Wa = ((const RunStats_t *)a)->WallSec;
+    double Wb = ((const RunStats_t *)b)->WallSec;
+    return Wa < Wb ? -1 : Wa > Wb ? 1 : 0;
+}
+
+//--------------------------------------------------------------------------
+// Results, as one JSON object per line.  The baseline is found again by
+// the "mode" and "cache" fields, which always come in this order.
+//--------------------------------------------------------------------------
+static void WriteResult(FILE * File, const Mode_t * Mode, const TCHAR * Cache, const RunStats_t * Stats)
+{
+    _ftprintf(File, TEXT("{\"label\":\"%s\",\"mode\":\"%s\",\"cache\":\"%s\",\"runs\":%d,")
+                    TEXT("\"files\":%llu,\"bytes\":%llu,\"wall_s\":%.3f,\"files_per_s\":%.0f,")
+                    TEXT("\"user_s\":%.3f,\"kernel_s\":%.3f,\"read_ops\":%llu,\"read_bytes\":%llu,")
+                    TEXT("\"write_ops\":%llu,\"write_bytes\":%llu,\"other_ops\":%llu,\"peak_rss_bytes\":%llu}\n"),
+        Label, Mode->Name, Cache, NumRuns,
+        TreeFiles, TreeBytes, Stats->WallSec, TreeFiles / Stats->WallSec,
+        Stats->UserSec, Stats->KernelSec, Stats->ReadOps, Stats->ReadBytes,
+        Stats->WriteOps, Stats->WriteBytes, Stats->OtherOps, Stats->PeakRss);
+}
+
+static void LoadBaseline(void)
+{
+    TCHAR Line[1024];
+    FILE * File = _tfopen(BaselineName, TEXT("r"));
+    if (File == NULL && GetFileAttributes(BaselineName) == INVALID_FILE_ATTRIBUTES && OutName == NULL){
+        // First run on this machine, it becomes the baseline.
+        _tprintf(TEXT("No baseline yet, recording one in '%s'\n"), BaselineName);
+        OutName = BaselineName;
+        BaselineName = NULL;
+        return;
+    }
+    if (File == NULL){
+        _ftprintf(stderr, TEXT("Could not open baseline '%s'\n"), BaselineName);
+        exit(EXIT_FAILURE);
+    }
+    while (NumBaseline < MAX_BASELINE && _fgetts(Line, 1024, File)){
+        if (_tcsstr(Line, TEXT("\"mode\":")) == NULL) continue;
+        Baseline[NumBaseline++] = _tcsdup(Line);
+    }
+    fclose(File);
+}
+
+static const TCHAR * FindBaseline(const Mode_t * Mode, const TCHAR * Cache)
+{
+    TCHAR Key[100];
+    int a;
+    _sntprintf(Key, 100, TEXT("\"mode\":\"%s\",\"cache\":\"%s\""), Mode->Name, Cache);
+    Key[99] = 0;
+    // The last entry wins, so a baseline file can be appended to.
+    for (a = NumBaseline - 1; a >= 0; a--){
+        if (_tcsstr(Baseline[a], Key)) return Baseline[a];
+    }
+    return NULL;
+}
+
+static double JsonNumber(const TCHAR * Line, const TCHAR * Name)
+{
+    TCHAR Key[50];
+    const TCHAR * Value;
+    _sntprintf(Key, 50, TEXT("\"%s\":"), Name);
+    Key[49] = 0;
+    Value = _tcsstr(Line, Key);
+    if (Value == NULL) return 0;
+    return _tcstod(Value + _tcslen(Key), NULL);
+}
+
+//--------------------------------------------------------------------------
+// Show the change of one measure against the baseline.  For all of them,
+// more is worse.
+//--------------------------------------------------------------------------
+static void CompareMeasure(const TCHAR * Base, const TCHAR * Name, double Value)
+{
+    double Old = JsonNumber(Base, Name);
+    double Change;
+    if (Old <= 0) return;
+    Change = (Value - Old) * 100 / Old;
+    _tprintf(TEXT("    %-16s %14.3f -> %14.3f  %+6.1f%%%s\n"), Name, Old, Value, Change,
+        Change > Threshold ? TEXT("  REGRESSION") : TEXT(""));
+    if (Change > Threshold) Regressions += 1;
+}
+
+static void Report(const Mode_t * Mode, const TCHAR * Cache, const RunStats_t * Stats)
+{
+    _tprintf(TEXT("%-9s %-5s %8.3f s %9.0f files/s %8.3f s cpu %8llu MB read %9llu I/O calls %6llu MB peak\n"),
+        Mode->Name, Cache, Stats->WallSec, TreeFiles / Stats->WallSec, Stats->UserSec + Stats->KernelSec,
+        Stats->ReadBytes >> 20, Stats->ReadOps + Stats->WriteOps + Stats->OtherOps, Stats->PeakRss >> 20);
+
+    if (OutName){
+        FILE * Out = _tfopen(OutName, TEXT("a"));
+        if (Out == NULL){
+            _ftprintf(stderr, TEXT("Could not open '%s' for writing\n"), OutName);
+            exit(EXIT_FAILURE);
+        }
+        WriteResult(Out, Mode, Cache, Stats);
+        fclose(Out);
+    }
+
+    if (BaselineName){
+        const TCHAR * Base = FindBaseline(Mode, Cache);
+        if (Base == NULL){
+            _tprintf(TEXT("    no baseline\n"));
+        }else{
+            CompareMeasure(Base, TEXT("wall_s"), Stats->WallSec);
+            CompareMeasure(Base, TEXT("user_s"), Stats->UserSec);
+            CompareMeasure(Base, TEXT("kernel_s"), Stats->KernelSec);
+            CompareMeasure(Base, TEXT("read_ops"), (double)Stats->ReadOps);
+            CompareMeasure(Base, TEXT("read_bytes"), (double)Stats->ReadBytes);
+            CompareMeasure(Base, TEXT("other_ops"), (double)Stats->OtherOps);
+            CompareMeasure(Base, TEXT("peak_rss_bytes"), (double)Stats->PeakRss);
+        }
+    }
+    fflush(stdout);
+}
+
+static void Usage (void)
+{
+    _tprintf(TEXT("runbench - run finddupe end to end on a test tree and record the cost\n\n"));
+    _tprintf(TEXT("Usage: runbench [options] <dir>\n"));
+    _tprintf(TEXT("Options:\n")
+           TEXT(" -exe <file>       finddupe to run (default: finddupe.exe)\n")
+           TEXT(" -gen <options>    Build the tree with gencorpus and these options (one\n")
+           TEXT("                   argument, quoted) first, and again after each -hardlink\n")
+           TEXT("                   run.  Without it, the hardlink mode is skipped\n")
+           TEXT(" -genexe <file>    gencorpus to run (default: gencorpus.exe)\n")
+           TEXT(" -modes <list>     Modes to run, comma separated: report, listlink, hardlink,\n")
+           TEXT("                   bat, sigs (default: all)\n")
+           TEXT(" -cache <list>     warm, cold or warm,cold (default: warm,cold)\n")
+           TEXT(" -runs <n>         Runs per mode and cache, the median is kept (default: 3)\n")
+           TEXT(" -label <text>     Name of this build or machine, recorded with the results\n")
+           TEXT(" -out <file>       Append the results to file, one JSON object per line\n")
+           TEXT(" -baseline <file>  Compare with results from an earlier -out file.  If the\n")
+           TEXT("                   file does not exist, record this run in it instead\n")
+           TEXT(" -threshold <pct>  Percent worse than the baseline that counts as a\n")
+           TEXT("                   regression (default: 10).  Exit code 2 if any\n")
+           );
+    exit(EXIT_FAILURE);
+}
+
+int _tmain (int argc, TCHAR **argv)
+{
+    static const TCHAR * Caches[] = {TEXT("warm"), TEXT("cold")};
+    RunStats_t Runs[MAX_RUNS];
+    LARGE_INTEGER Freq;
+    int argn, m, c, r;
+
+    for (argn = 1; argn < argc - 1; argn++){
+        TCHAR * arg = argv[argn];
+        if (arg[0] != '-') break;
+        if (!_tcscmp(arg, TEXT("-exe"))){
+            ExeName = argv[++argn];
+        }else if (!_tcscmp(arg, TEXT("-gen"))){
+            GenOptions = argv[++argn];
+        }else if (!_tcscmp(arg, TEXT("-genexe"))){
+            GenName = argv[++argn];
+        }else if (!_tcscmp(arg, TEXT("-modes"))){
+            ModeList = argv[++argn];
+        }else if (!_tcscmp(arg, TEXT("-cache"))){
+            CacheList = argv[++argn];
+        }else if (!_tcscmp(arg, TEXT("-runs"))){
+            NumRuns = _ttoi(argv[++argn]);
+        }else if (!_tcscmp(arg, TEXT("-label"))){
+            Label = argv[++argn];
+        }else if (!_tcscmp(arg, TEXT("-out"))){
+            OutName = argv[++argn];
+        }else if (!_tcscmp(arg, TEXT("-baseline"))){
+            BaselineName = argv[++argn];
+        }else if (!_tcscmp(arg, TEXT("-threshold"))){
+            Threshold = _tstof(argv[++argn]);
+        }else{
+            Usage();
+        }
+    }
+    if (argn != argc - 1 || NumRuns < 1 || NumRuns > MAX_RUNS) Usage();
+    TreeDir = argv[argn];
+
+    QueryPerformanceFrequency(&Freq);
+    Frequency = Freq.QuadPart;
+
+    // The batch file must not land in the tree, or later runs would find it.
+    if (GetTempPath(MAX_PATH - 20, BatName) == 0) _tcscpy(BatName, TEXT(".\\"));
+    _tcscat(BatName, TEXT("runbench.bat"));
+
+    if (BaselineName) LoadBaseline();
+    if (GenOptions) BuildTree();
+    WalkTree(TreeDir, FALSE);
+    if (TreeFiles == 0){
+        _ftprintf(stderr, TEXT("No files in '%s'\n"), TreeDir);
+        exit(EXIT_FAILURE);
+    }
+    _tprintf(TEXT("%s: %llu files, %llu MB, %d runs each\n"), TreeDir, TreeFiles, TreeBytes >> 20, NumRuns);
+
+    for (m = 0; m < NUM_MODES; m++){
+        const Mode_t * Mode = &Modes[m];
+        if (!InList(ModeList, Mode->Name)) continue;
+        if (Mode->Changes && GenOptions == NULL){
+            _tprintf(TEXT("%-9s skipped, needs -gen to rebuild the tree after each run\n"), Mode->Name);
+            continue;
+        }
+        for (c = 0; c < 2; c++){
+            int Cold = c == 1;
+            if (!InList(CacheList, Caches[c])) continue;
+
+            // Fill the cache first.  The rebuilt tree is in the cache already.
+            if (!Cold && !Mode->Changes) RunFinddupe(Mode, NULL);
+
+            for (r = 0; r < NumRuns; r++){
+                if (Cold) WalkTree(TreeDir, TRUE);
+                RunFinddupe(Mode, &Runs[r]);
+                if (Mode->Changes) BuildTree();
+            }
+            qsort(Runs, NumRuns, sizeof(RunStats_t), CompareWall);
+            Report(Mode, Caches[c], &Runs[NumRuns / 2]);
+        }
+    }
+    DeleteFile(BatName);
+
+    if (Regressions){
+        _tprintf(TEXT("%d measures worse than the baseline by more than %.0f%%\n"), Regressions, Threshold);
+        return 2;
+    }
+    return EXIT_SUCCESS;
+}
@@ -36,6 +36,28 @@
 //     added a 64-bit version for addressing more memory
 // Version 1.34  (c) Sep 2024  thomas694
 //     fixed a display problem with the progress indicator
+// Version 1.35  Oct 2026
+//     added option to prune ignored directories while traversing
+//     reference directories are kept in a hash set instead of a list
+//     listlink mode groups hardlinks by volume and file index in a hash table
+//     files are only opened when a signature is needed
+//     file size is taken from the directory listing
+//     exact path set instead of filename CRCs for files already seen
+//     duplicate groups are resolved after the scan, full reads run in parallel
+//     signatures and full reads are done in order of position on disk
+//     added option for comparison tiers (head, tail, sampled blocks) and statistics
+//     length of the head signature adapts per file size class
+//     large files are read in parts in parallel for the full compare
+//     reads are scheduled per disk, spinning disks are read one file at a time
+//     added options to limit read rate and file opens, and for idle priority
+//     added file cache hints for the full compare (sequential, prefetch, drop)
+//     added option to read past the file cache, reads use a pool of aligned buffers
+//     added option to time each stage, with latency histograms
+//     added option to write a trace of the stages for trace viewers
+//     added option to write metrics for the Prometheus textfile collector
+//     progress is shown by a thread of its own, with throughput and time left
+//     state of a scan kept per scan, usable as a library (finddupe.h) with callbacks
+//     per file work expanded once per mode, options are not checked for every file
 //
 // finddupe is free software: you can redistribute it and/or modify
 // it under the terms of the GNU General Public License as published by
@@ -51,13 +73,14 @@
 // along with this program.  If not, see <http://www.gnu.org/licenses/>.
 //--------------------------------------------------------------------------
 
-#define VERSION "1.34"
+#define VERSION "1.35"
 
 #define REF_CODE
 
 #include <locale.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <stddef.h>
 #include <memory.h>
 #include <string.h>
 #include <tchar.h>
@@ -65,6 +88,7 @@
 #include <sys/stat.h>
 #include <errno.h>
 #include <ctype.h>
+#include <setjmp.h>
 
 #include <shlwapi.h> /* StrStrI */
 #pragma comment(lib, "shlwapi.lib") /* unresolved external symbol __imp__StrStrIW@8 */
@@ -75,32 +99,49 @@
 #define WIN32_LEAN_AND_MEAN // To keep windows.h bloat down.    
 #define _WIN32_WINNT 0x0500
 #include <windows.h>
+#include <winioctl.h>
+#include <psapi.h> /* GetProcessMemoryInfo */
+#pragma comment(lib, "psapi.lib")
 #include <direct.h>
 #include <fcntl.h>
 
 #include "khash.h"
+#include "myglob.h"
+#include "finddupe.h"
 
 #define  S_IWUSR  0x80      // user has write permission
 #define  S_IWGRP  0x10      // group has write permission
 #define  S_IWOTH  0x02      // others have write permisson
 
-static int FilesMatched;
-
-DWORD totalCompare;
-DWORD totalPrint;
-DWORD totalFileInfo;
-DWORD totalByteRead;
-DWORD totalCRC;
-DWORD totalCheck;
-DWORD ticksCheck;
-
 typedef struct {
     unsigned int Crc;
     unsigned int Sum;
 }Checksum_t;
 
-KHASH_MAP_INIT_INT64(hset, Checksum_t)
-KHASH_MAP_INIT_INT64(hmap, UINT64)
+//--------------------------------------------------------------------------
+// FNV-1a hash of a string, used for path keyed hash sets
+//--------------------------------------------------------------------------
+static kh_inline khint_t TStrHash(const TCHAR * s)
+{
+    khint_t h = 2166136261u;
+    for (; *s; s++) {
+        h ^= (khint_t)*s;
+        h *= 16777619u;
+    }
+    return h;
+}
+#define TStrEqual(a, b) (_tcscmp(a, b) == 0)
+
+// Paths of files already seen.  The hash is calculated once per file.
+typedef struct {
+    const TCHAR * Name;
+    khint_t Hash;
+}PathKey_t;
+#define PathKeyHash(key) ((key).Hash)
+#define PathKeyEqual(a, b) ((a).Hash == (b).Hash && _tcscmp((a).Name, (b).Name) == 0)
+
+KHASH_INIT(pathset, PathKey_t, char, 0, PathKeyHash, PathKeyEqual)
+KHASH_INIT(refdir, const TCHAR*, char, 0, TStrHash, TStrEqual)
 
 // Data structure for file allocations:
 typedef struct FileData_t FileData_t;
@@ -109,70 +150,405 @@ struct FileData_t {
     struct {
         int High;
         int Low;
+        DWORD Volume;       // File indexes are only unique per volume
     }FileIndex;    
     int NumLinks; 
+    int IsReference;        // Reference file or in a reference directory, never eliminated
+    int Seq;                // Arrival order
     UINT64 FileSize;
+    UINT64 FirstCluster;    // Where the data starts on the volume, to order reads
+    int Device;             // Disk the file is on, reads are scheduled per disk
     TCHAR * FileName;
-    FileData_t * Larger;    // Child pointer for larger child
-    FileData_t * Smaller;   // Child pointer for smaller child
+    Checksum_t FullChecksum;// Checksum of the whole file, Crc 0 if not calculated yet
+    FileData_t * Next;      // Next file of the same size (or of the same hardlink group)
 };
-static FileData_t * FileData;
-static int NumAllocated;
-static int NumUnique;
-static khash_t(hset) * FilenameSet;
-static khash_t(hmap) * FileDataMap;
 
-#define UNITS_PER_ALLOCATION 102400
+// All files of one size, in arrival order.
+typedef struct {
+    FileData_t * First;
+    FileData_t * Last;
+    int Count;
+}SizeBucket_t;
+KHASH_MAP_INIT_INT64(hmap, SizeBucket_t)
 
-#ifdef REF_CODE
-TCHAR* * PathData;
-int PathAllocated;
-int PathUnique;
-#endif
+// Hardlink search mode: files are grouped by volume and file index.
+typedef struct {
+    DWORD Volume;
+    DWORD High;
+    DWORD Low;
+}FileId_t;
+
+typedef struct {
+    FileData_t * First;     // First instance found, others are chained via Next
+    FileData_t * Last;
+    FileData_t * Printed;   // Last instance printed, NULL until the group is printed
+    int Found;              // Number of instances found in search tree
+}LinkGroup_t;
+
+#define FileIdHash(key) (khint32_t)((key).Low ^ (key).High * 0x9E3779B1u ^ (key).Volume * 0x85EBCA77u)
+#define FileIdEqual(a, b) ((a).Low == (b).Low && (a).High == (b).High && (a).Volume == (b).Volume)
+KHASH_INIT(hlink, FileId_t, LinkGroup_t, 1, FileIdHash, FileIdEqual)
 
-// Duplicate statistics summary
-struct {
-    int TotalFiles;
-    int DuplicateFiles;
-    int HardlinkGroups;
-    int CantReadFiles;
-    int ZeroLengthFiles;
-    int IgnoredFiles;
-    UINT64 TotalBytes;
-    UINT64 DuplicateBytes;
-}DupeStats;
+#define UNITS_PER_ALLOCATION 102400
 
 // How many bytes to calculate file signature of.
 #define BYTES_DO_CHECKSUM_OF 32768
 
+// Comparison tiers: candidate groups are split by the checksum of each tier
+// in turn, only files still sharing a group go on to the next tier, and
+// finally to the full compare.
+#define TIER_HEAD   0
+#define TIER_TAIL   1
+#define TIER_SAMPLE 2
+#define TIER_FULL   3
+#define MAX_TIERS   8
+
+typedef struct {
+    int Kind;
+    int Blocks;             // Number of blocks sampled
+    UINT64 Bytes;           // Bytes to read (per block for samples)
+    // Statistics
+    int Groups;             // Groups that went into this tier
+    int Files;              // Files in those groups
+    int FilesRead;
+    int RuledOut;           // Files not sharing a group anymore after this tier
+    UINT64 BytesRead;
+}Tier_t;
+
+static const TCHAR * TierNames[] = {TEXT("head"), TEXT("tail"), TEXT("sample"), TEXT("full")};
+
+// When the first tier reads the head of the files, its length is kept per
+// size class (log2 of the file size) and adapted between batches of groups:
+// doubled where groups with equal heads often turn out to differ, halved
+// where they never do.
+#define MIN_PREFIX      4096
+#define MAX_PREFIX      (1 << 20)
+#define BATCH_FILES     4096    // Candidates resolved per batch
+
+#define STAGE_ENUMERATE  0   // Directory listings (myglob.c)
+#define STAGE_OPEN       1
+#define STAGE_METADATA   2   // File index, link count and first cluster
+#define STAGE_PREFIX     3   // Reads for the signature tiers
+#define STAGE_HASH       4
+#define STAGE_INSERT     5   // Storing a file in the bucket of its size
+#define STAGE_FULL       6   // Reads for the full compare
+#define STAGE_ACTION     7   // Deleting, linking or writing the batch file
+#define STAGE_OUTPUT     8
+#define NUM_STAGES       9
+
+#define TIMING_BUCKETS   42  // Bucket b holds times below 2^b ns, the last one the rest
+#define TIMING_SLOTS     (MAXIMUM_WAIT_OBJECTS + 1) // Main thread, then the read threads
+
+typedef struct {
+    UINT64 Count;
+    UINT64 TotalNs;
+    UINT64 MaxNs;
+    UINT64 Buckets[TIMING_BUCKETS];
+}StageTimes_t;
+
+// Bytes read and hashed, per thread slot like the stage times.
+typedef struct {
+    UINT64 BytesRead;
+    UINT64 BytesHashed;
+}IoCounts_t;
+
+typedef struct {
+    int Stage;
+    LONGLONG Start;
+    LONGLONG End;
+}TraceEvent_t;
+
+typedef struct {
+    double Rate;            // Tokens per second, 0 for no limit
+    double Tokens;
+    LONGLONG Last;          // Performance counter at last refill
+}TokenBucket_t;
+
+// The head of the next job of a read thread, read while it works on the job
+// before (-cache prefetch).  The job goes on reading through the same handle.
+typedef struct {
+    HANDLE Handle;          // Opened with FILE_FLAG_OVERLAPPED
+    char * Buffer;
+    OVERLAPPED Overlapped;
+}ReadAhead_t;
+
+typedef struct {
+    int Candidate;
+    int Part;               // Part of a large file, -1 for the whole file
+    int Failed;
+    ReadAhead_t * Ahead;    // Head being read already, or NULL
+    Checksum_t Sum;         // Checksum of the part
+}ReadJob_t;
+
+typedef void (*ReadJobFunc_t)(ReadJob_t * Job);
+
+// Cache hints, looked up at run time (newer than the Windows version this
+// is built for).
+typedef BOOL (WINAPI * SetThreadInformation_t)(HANDLE, int, void *, DWORD);
+
+//--------------------------------------------------------------------------
+// Disks the candidates are on.  Each gets its own share of the read threads:
+// a spinning disk only HddThreads, so its sweep is not broken up by seeks,
+// solid state disks (and anything unknown) NumThreads.  Several disks are
+// read at the same time.
+//--------------------------------------------------------------------------
+typedef struct {
+    DWORD Volume;           // Volume serial number
+    int Device;
+}VolumeDevice_t;
+
+typedef struct {
+    DWORD DiskNumber;       // Physical disk number, or -1 if not known
+    DWORD Volume;           // Volume it was found on, if the disk is not known
+    int Rotational;
+    int Limit;              // Reads at once
+    // Jobs of the current stage
+    volatile LONG Next;
+    int End;
+    volatile LONG Active;   // Threads working on this disk
+}Device_t;
+
+//--------------------------------------------------------------------------
+// One scan (finddupe.h).  What a scan works on is kept here instead of in
+// globals, so a program can run scans one after the other, or several at once
+// on different threads.  The code works on the scan of the thread it runs
+// on, Ctx, which the read, metrics and progress threads take over from the
+// thread that started them.
+//--------------------------------------------------------------------------
+struct Finddupe_t {
+    // Parameters for what to do
+    FILE * BatchFile;           // Output a batch file
+    TCHAR * BatchFileName;
+    int PrintFileSigs;          // Print signatures of files
+    int PrintDuplicates;        // Print duplicates
+    int MakeHardLinks;          // Do the actual hard linking
+    int DelDuplicates;          // Delete duplicates (no hard linking)
+    int ReferenceFiles;         // Flag - do not touch present files parsed
+    int DoReadonly;             // Do it for readonly files also
+    int Verbose;
+    int HardlinkSearchMode;     // Detect hard links only (do not check duplicates)
+    int ShowProgress;           // Show progressing file count...
+    int HideCantReadMessage;    // Hide the can't read file error
+    int SkipZeroLength;         // Ignore zero length files.
+    int FollowReparse;          // Whether to follow reparse points (like unix softlinks for NTFS)
+    int ShowTiming;             // Time the stages and print their latency histograms
+    TCHAR * TraceFileName;      // Trace of the stages in Chrome trace format
+    TCHAR * MetricsFileName;    // Metrics for the Prometheus textfile collector
+    int SkipLinkedDuplicates;   // Skip linked duplicates and show only unlinked ones
+    int NumThreads;             // Threads for full file reads (0: number of processors, max. 8)
+    int ShowStats;              // Show statistics of the comparison tiers
+    int HddThreads;             // Reads at once on a disk with seek penalty
+    int IdlePriority;           // Read with background (very low) I/O priority
+    TCHAR * ControlFileName;    // File with read limits, checked while running
+    int CacheHints;             // CACHE_ flags for full reads, -1 until set
+    int DirectIO;               // Read past the file cache (FILE_FLAG_NO_BUFFERING)
+
+    TCHAR* * IgnorePatterns;    // Patterns of filename to ignore (can be repeated, eg. .bak, .tmp)
+    int IgnorePatternsAlloc;    // Number of allocated ignore patterns
+    int IgnorePatternsCount;    // Number of specified ignore patterns
+    TCHAR* * IgnoreDirPatterns; // Patterns of directory names to prune (eg. .git, node_modules)
+    int IgnoreDirPatternsAlloc; // Number of allocated ignore directory patterns
+    int IgnoreDirPatternsCount; // Number of specified ignore directory patterns
+
+    TCHAR ** Patterns;          // Copies of the file patterns, with -ref in between
+    int NumPatterns;
+
+    // Callbacks
+    FinddupeGroupFunc_t OnGroup;
+    FinddupeProgressFunc_t OnProgress;
+    FinddupeOutputFunc_t OnOutput;
+    void * User;
+    FileData_t ** GroupMembers;
+    int GroupMembersAlloc;
+    FinddupeFile_t * GroupFiles;
+    int GroupFilesAlloc;
+
+    // Where Fatal returns to, on the thread that called in
+    jmp_buf Abort;
+    DWORD Owner;
+    volatile LONG Failed;       // A read thread gave up, see Fatal
+
+    // Console, shared with the progress thread
+    CRITICAL_SECTION ConsoleLock;
+    volatile LONG ConsoleShared; // Progress thread running
+    int ProgressIndicatorVisible; // Weither a progress indicator needs to be overwritten.
+    BOOL NewConsoleMode;        // Console takes escape sequences
+
+    // Files found
+    int FilesMatched;           // Of the current file pattern
+    volatile int FilesScanned;  // Of all patterns, only goes up (metrics, progress)
+    FileData_t * FileData;      // Block being filled
+    int NumAllocated;
+    int NumUnique;
+    FileData_t ** FileDataBlocks;
+    int NumFileDataBlocks;
+    int FileDataBlocksAlloc;
+    TCHAR * NameBlock;          // Names are kept in blocks, see KeepName
+    size_t NameBlockLeft;
+    TCHAR ** NameBlocks;
+    int NumNameBlocks;
+    int NameBlocksAlloc;
+    khash_t(pathset) * FilenameSet;
+    khash_t(hmap) * FileDataMap;
+    khash_t(hlink) * LinkGroupMap;
+    #ifdef REF_CODE
+    khash_t(refdir) * RefDirSet; // Directories matched by -ref patterns
+    #endif
+    FinddupeStats_t DupeStats;  // Duplicate statistics summary
+
+    // Comparison tiers
+    Tier_t Tiers[MAX_TIERS+1];  // The full compare comes last
+    int NumTiers;
+    UINT64 PrefixBytes[64];
+    int PrefixGroups[64];       // Groups compared in full since the last change
+    int PrefixMisses[64];       // Of those, groups that turned out to differ
+    int PrefixChanged;
+
+    // Stage timing and trace
+    LONGLONG CounterFrequency;
+    int TimingHandler;          // Counted in TimingScans
+    LONG TimingSeen;            // Ctrl+Break presses handled so far
+    StageTimes_t StageTimes[TIMING_SLOTS][NUM_STAGES];
+    int ReadStage;              // Stage that reads count as
+    int TimersOn;               // -timing or -trace
+    IoCounts_t IoCounts[TIMING_SLOTS];
+    FILE * TraceFile;
+    TraceEvent_t * TraceEvents[TIMING_SLOTS];
+    int NumTraceEvents[TIMING_SLOTS];
+    CRITICAL_SECTION TraceLock;
+    LONGLONG TraceStart;
+    int TraceWritten;           // Events in the file so far
+
+    // Read limits, buffers and cache hints
+    SetThreadInformation_t SetThreadInformationFunc;
+    TokenBucket_t ReadBytesLimit;
+    TokenBucket_t OpensLimit;
+    CRITICAL_SECTION ThrottleLock;
+    __time64_t ControlChange;   // Time stamp of the control file when last read
+    DWORD ControlPoll;
+    char * FreeBuffers[MAXIMUM_WAIT_OBJECTS + 1];
+    int NumFreeBuffers;
+    CRITICAL_SECTION BufferLock;
+
+    // Candidate groups
+    FileData_t ** Candidates;   // Members of all groups
+    int * CandidateLink;        // Earlier member with the same file index, or -1
+    signed char * CandidateState; // One of the CAND_ values
+    int NumCandidates;
+    int CandidatesAlloc;
+    int CandidateLinkAlloc;
+    int CandidateStateAlloc;
+    int * GroupEnd;             // Index behind the last member of each group
+    int NumGroups;
+    int GroupsAlloc;
+    int * OldEnd;               // For SplitGroups
+    int OldEndAlloc;
+    FileData_t ** Keepers;      // For ResolveGroup
+    int KeepersAlloc;
+    int * ClassOf;
+    int ClassOfAlloc;
+    int * ClassSize;
+    int ClassSizeAlloc;
+    const Tier_t * CurrentTier; // Tier the signature jobs read for
+
+    // Read jobs
+    ReadJob_t * ReadJobs;
+    int NumReadJobs;
+    int ReadJobsAlloc;
+    ReadJobFunc_t ReadJobFunc;
+    volatile LONG ReadJobsDone;
+    VolumeDevice_t * Volumes;
+    int NumVolumes;
+    int VolumesAlloc;
+    Device_t * Devices;
+    int NumDevices;
+    int DevicesAlloc;
+    // Queues of the running stage: the disks, or one queue for all while the
+    // disks are not known yet.
+    Device_t * Queues;
+    int NumQueues;
+    Device_t AllJobs;
+
+    // For the progress thread
+    const TCHAR * volatile ProgressWhat; // Read stage running, NULL while scanning
+    UINT64 CandidateBytes;      // In all groups of equal size
+    int CandidateFiles;
+    volatile UINT64 ResolvedBytes; // In the groups resolved so far
+    volatile int ResolvedFiles;
+    DWORD ResolveStart;         // Tick count when comparing started
+
+    HANDLE MetricsThread;
+    HANDLE MetricsStop;
+    HANDLE ProgressThread;
+    HANDLE ProgressStop;
+};
+
+static __declspec(thread) Finddupe_t * Ctx;   // Scan of this thread
 
-// Parameters for what to do
-FILE * BatchFile = NULL;        // Output a batch file
-TCHAR * BatchFileName = NULL;
+static void ReleaseConsole(void);
+
+//--------------------------------------------------------------------------
+// Give up on the scan, after the error was printed.  The call into the scan
+// returns EXIT_FAILURE, what the scan holds is freed by FinddupeFree.  A read
+// thread can't unwind the thread that called in: it marks the scan failed and
+// ends, the other read threads stop taking jobs, and the thread that called
+// in gives up when they are done (RunReadJobs).
+//--------------------------------------------------------------------------
+static void Fatal(void)
+{
+    if (Ctx == NULL) exit(EXIT_FAILURE);
+    if (Ctx->Owner == GetCurrentThreadId()) longjmp(Ctx->Abort, 1);
+    Ctx->Failed = 1;
+    ReleaseConsole();
+    _endthreadex(EXIT_FAILURE);
+}
+
+//--------------------------------------------------------------------------
+// Output of the scan: to stdout and stderr, or to the output callback of the
+// scan if one is set (finddupe.h).
+//--------------------------------------------------------------------------
+#define OUTPUT_CHARS 4096
+
+static void PrintTo(int IsError, const TCHAR * Format, va_list Args)
+{
+    if (Ctx != NULL && Ctx->OnOutput){
+        TCHAR Text[OUTPUT_CHARS];
+        _vsntprintf(Text, OUTPUT_CHARS, Format, Args);
+        Text[OUTPUT_CHARS-1] = '\0';
+        Ctx->OnOutput(Ctx->User, IsError, Text);
+    }else{
+        _vftprintf(IsError ? stderr : stdout, Format, Args);
+    }
+}
+
+static void Print(const TCHAR * Format, ...)
+{
+    va_list Args;
+    va_start(Args, Format);
+    PrintTo(0, Format, Args);
+    va_end(Args);
+}
 
-int PrintFileSigs;         // Print signatures of files
-int PrintDuplicates;       // Print duplicates
-int MakeHardLinks;         // Do the actual hard linking
-int DelDuplicates;         // Delete duplicates (no hard linking)
-int ReferenceFiles;        // Flag - do not touch present files parsed
-int DoReadonly;            // Do it for readonly files also
-int Verbose;
-int HardlinkSearchMode;    // Detect hard links only (do not check duplicates)
-int ShowProgress = 1;      // Show progressing file count...
-int HideCantReadMessage= 0;// Hide the can't read file error
-int SkipZeroLength = 1;    // Ignore zero length files.
-int ProgressIndicatorVisible = 0; // Weither a progress indicator needs to be overwritten.
-int FollowReparse = 0;     // Whether to follow reparse points (like unix softlinks for NTFS)
-int MeasureDurations = 0;  // Measure how many ticks the different tasks take
-int SkipLinkedDuplicates = 0; // Skip linked duplicates and show only unlinked ones
+static void PrintError(const TCHAR * Format, ...)
+{
+    va_list Args;
+    va_start(Args, Format);
+    PrintTo(1, Format, Args);
+    va_end(Args);
+}
 
-TCHAR* * IgnorePatterns;   // Patterns of filename to ignore (can be repeated, eg. .bak, .tmp)
-int IgnorePatternsAlloc;   // Number of allocated ignore patterns
-int IgnorePatternsCount;   // Number of specified ignore patterns
-UINT m_old_code_page;
-BOOL NewConsoleMode;
+static void * GrowArray(void * Array, int * Alloc, int Need, size_t Size)
+{
+    if (Need <= *Alloc) return Array;
+    *Alloc = Need + Need/2 + 16;
+    Array = realloc(Array, *Alloc * Size);
+    if (Array == NULL){
+        PrintError(TEXT("Malloc failure"));
+        Fatal();
+    }
+    return Array;
+}
 
-int MyGlob(const TCHAR * Pattern, int FollowReparse, void (*FileFuncParm)(const TCHAR * FileName));
 
 
 //--------------------------------------------------------------------------
@@ -194,14 +570,34 @@ static void CalcCrc(Checksum_t * Check, char * Data, unsigned NumBytes)
     Check->Sum = Sum;
 }
 
+//--------------------------------------------------------------------------
+// The console is shared with the progress thread of the scan.  A thread
+// that prints starts with ClearProgressInd, which takes the console until
+// the thread gets to ReleaseConsole, so the progress line never lands in its
+// output.
+//--------------------------------------------------------------------------
+static __declspec(thread) int HoldsConsole;
+
+static void ReleaseConsole(void)
+{
+    if (!HoldsConsole) return;
+    fflush(stdout);
+    HoldsConsole = 0;
+    LeaveCriticalSection(&Ctx->ConsoleLock);
+}
+
 //--------------------------------------------------------------------------
 // Clear line (erase the progress indicator)
 //--------------------------------------------------------------------------
 void ClearProgressInd(void)
 {
-    if (ProgressIndicatorVisible) {
-        _tprintf(NewConsoleMode ? TEXT("\33[2K\r") : TEXT("                                                                             \r"));
-        ProgressIndicatorVisible = 0;
+    if (Ctx->ConsoleShared && !HoldsConsole){
+        EnterCriticalSection(&Ctx->ConsoleLock);
+        HoldsConsole = 1;
+    }
+    if (Ctx->ProgressIndicatorVisible) {
+        _tprintf(Ctx->NewConsoleMode ? TEXT("\33[2K\r") : TEXT("                                                                             \r"));
+        Ctx->ProgressIndicatorVisible = 0;
     }
 }
 
@@ -210,7 +606,7 @@ void ClearProgressInd(void)
 //--------------------------------------------------------------------------
 TCHAR * EscapeBatchName(TCHAR * Name)
 {
-    static TCHAR EscName[_MAX_PATH*2];
+    static __declspec(thread) TCHAR EscName[_MAX_PATH*2];
     int a,b;
     b = 0;
     for (a=0;;){
@@ -222,54 +618,35 @@ TCHAR * EscapeBatchName(TCHAR * Name)
     return EscName;
 }
 
-static INT64 CalcFilenameCRC(TCHAR* filename)
-{
-    unsigned int len = _tcslen(filename);
-#ifdef UNICODE
-    len = len * 2;
-#endif
-    char* charFileName = (char*)filename;
-
-    Checksum_t checkSum = { .Crc = 0, .Sum = 0 };
-    CalcCrc(&checkSum, charFileName, len);
-
-    INT64 crc = (INT64)(((UINT64)checkSum.Crc) << 32 | ((UINT64)checkSum.Sum));
-    return crc;
-}
-
-static khiter_t kh_get_fn(INT64 filenameCRC, int createNew, int* created)
+static int IsKnownPath(const TCHAR* FileName, khint_t PathHash)
 {
-    khint_t k = kh_get(hset, FilenameSet, filenameCRC);
-    if (createNew && k == kh_end(FilenameSet))
-    {
-        *created = 1;
-        k = kh_put_fn(filenameCRC);
-    }
-    else
-        *created = 0;
-    return k;
+    PathKey_t Key;
+    Key.Name = FileName;
+    Key.Hash = PathHash;
+    return kh_get(pathset, Ctx->FilenameSet, Key) != kh_end(Ctx->FilenameSet);
 }
 
-static khiter_t kh_put_fn(INT64 filenameCRC)
+// FileName must stay allocated as long as the set exists.
+static void AddKnownPath(const TCHAR* FileName, khint_t PathHash)
 {
     int ret;
-    khint_t k = kh_put(hset, FilenameSet, filenameCRC, &ret);
+    PathKey_t Key;
+    Key.Name = FileName;
+    Key.Hash = PathHash;
+    kh_put(pathset, Ctx->FilenameSet, Key, &ret);
     if (ret == -1) {
-        _ftprintf(stderr, TEXT("error storing new filename entry"));
-        kh_destroy(hset, FilenameSet);
-        exit(EXIT_FAILURE);
+        PrintError(TEXT("error storing new filename entry"));
+        Fatal();
     }
-    if (ret == 0) return k;
-
-    Checksum_t chk = { 0 };
-    kh_value(FilenameSet, k) = chk;
-    return k;
 }
 
+static khiter_t kh_put_fd(UINT64 fileSize);
+static int ReadFileAndCalculateCRC(TCHAR* fileName, UINT64 fileSize, Checksum_t* checksum, ReadAhead_t * Ahead);
+
 static khiter_t kh_get_fd(UINT64 fileSize, int createNew, int* found)
 {
-    khint_t k = kh_get(hmap, FileDataMap, fileSize);
-    if (k == kh_end(FileDataMap))
+    khint_t k = kh_get(hmap, Ctx->FileDataMap, fileSize);
+    if (k == kh_end(Ctx->FileDataMap))
     {
         *found = 0;
         if (createNew) k = kh_put_fd(fileSize);
@@ -282,15 +659,14 @@ static khiter_t kh_get_fd(UINT64 fileSize, int createNew, int* found)
 static khiter_t kh_put_fd(UINT64 fileSize)
 {
     int ret;
-    khint_t k = kh_put(hmap, FileDataMap, fileSize, &ret);
+    khint_t k = kh_put(hmap, Ctx->FileDataMap, fileSize, &ret);
     if (ret == -1) {
-        _ftprintf(stderr, TEXT("error storing new file entry"));
-        kh_destroy(hmap, FileDataMap);
-        exit(EXIT_FAILURE);
+        PrintError(TEXT("error storing new file entry"));
+        Fatal();
     }
     if (ret == 0) return k;
 
-    kh_value(FileDataMap, k) = NULL;
+    memset(&kh_value(Ctx->FileDataMap, k), 0, sizeof(SizeBucket_t));
     return k;
 }
 
@@ -322,603 +698,2481 @@ void ftprintf(FILE* file, TCHAR* format, ...) {
 }
 
 //--------------------------------------------------------------------------
-// Eliminate duplicates.
+// Stage timing (-timing).  Each stage is timed with the performance counter
+// and counted, totalled and sorted into a histogram of power of two buckets of
+// nanoseconds.  Each thread adds to its own slot, so timing takes no locks,
+// the slots are summed when printed.  Ctrl+Break prints the figures so far.
+// With -trace, every timed call is also written as a trace event.
+//--------------------------------------------------------------------------
+static const TCHAR * StageNames[NUM_STAGES] = {
+    TEXT("enumerate"), TEXT("open"), TEXT("metadata"), TEXT("prefix read"), TEXT("hash"),
+    TEXT("insert"), TEXT("full read"), TEXT("action"), TEXT("output")
+};
+
+static __declspec(thread) int TimingSlot;   // Slot of this thread
+
+// Ctrl+Break is for the whole process: the handler counts the presses, each
+// scan with -timing prints when the count moved on since it last looked.
+static volatile LONG TimingRequests;
+static volatile LONG TimingScans;           // Scans with -timing running
+static volatile LONG TimingHandlerSet;
+
+//--------------------------------------------------------------------------
+// Trace (-trace): one complete event per timed call, in the JSON array format
+// of the Chrome trace viewer (chrome://tracing, ui.perfetto.dev).  Events are
+// kept per thread slot and written out when a slot's buffer is full, so
+// threads only take the lock once per TRACE_BUFFER events.
 //--------------------------------------------------------------------------
-static int EliminateDuplicate(FileData_t ThisFile, FileData_t DupeOf)
+#define TRACE_BUFFER 4096
+
+static double TraceMicroseconds(LONGLONG Ticks)
 {
-    // First compare whole file.  If mismatch, return 0.
-    int IsDuplicate = 0;
-    int IsError = 0;
-    int Hardlinked = 0;
-    int IsReadonly;
-    struct _stat64 FileStat;
-    int doCalc1 = 0, doCalc2 = 0;
-    Checksum_t chk1 = { .Crc = 0,.Sum = 0 };
-    Checksum_t chk2 = { .Crc = 0,.Sum = 0 };
+    return (double)Ticks * 1000000 / Ctx->CounterFrequency;
+}
 
-    if (ThisFile.FileSize != DupeOf.FileSize) return 0;
+static void FlushTrace(int Slot)
+{
+    int a;
 
-    Hardlinked = 0;
-    if (DupeOf.NumLinks && memcmp(&ThisFile.FileIndex, &DupeOf.FileIndex, sizeof(DupeOf.FileIndex)) == 0){
-        Hardlinked = 1;
-        goto dont_read;
+    EnterCriticalSection(&Ctx->TraceLock);
+    for (a = 0; a < Ctx->NumTraceEvents[Slot]; a++){
+        TraceEvent_t * Event = &Ctx->TraceEvents[Slot][a];
+        _ftprintf(Ctx->TraceFile, TEXT("%s{\"name\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d}"),
+            Ctx->TraceWritten++ ? TEXT(",\n") : TEXT(""), StageNames[Event->Stage],
+            TraceMicroseconds(Event->Start - Ctx->TraceStart), TraceMicroseconds(Event->End - Event->Start), Slot);
     }
+    LeaveCriticalSection(&Ctx->TraceLock);
+    Ctx->NumTraceEvents[Slot] = 0;
+}
 
-    if (DupeOf.NumLinks >= 1023) {
-        // Do not link more than 1023 files onto one physical file (windows limit)
-        return 0;
+static void TraceEvent(int Stage, LONGLONG Start, LONGLONG End)
+{
+    int Slot = TimingSlot;
+    TraceEvent_t * Event;
+
+    if (Ctx->TraceEvents[Slot] == NULL){
+        Ctx->TraceEvents[Slot] = (TraceEvent_t *)malloc(TRACE_BUFFER * sizeof(TraceEvent_t));
+        if (Ctx->TraceEvents[Slot] == NULL){
+            PrintError(TEXT("Malloc failure"));
+            Fatal();
+        }
     }
+    if (Ctx->NumTraceEvents[Slot] == TRACE_BUFFER) FlushTrace(Slot);
+
+    Event = &Ctx->TraceEvents[Slot][Ctx->NumTraceEvents[Slot]++];
+    Event->Stage = Stage;
+    Event->Start = Start;
+    Event->End = End;
+}
 
-    INT64 fnCRC1, fnCRC2;
-    fnCRC1 = CalcFilenameCRC(ThisFile.FileName);
-    fnCRC2 = CalcFilenameCRC(DupeOf.FileName);
+static void OpenTrace(void)
+{
+    LARGE_INTEGER Now;
 
-    khint_t k1 = kh_get_fn(fnCRC1, 1, &doCalc1);
-    if (!doCalc1) {
-        chk1 = kh_value(FilenameSet, k1);
-        if (chk1.Crc == 0) doCalc1 = 1;
+    Ctx->TraceFile = _tfopen(Ctx->TraceFileName, TEXT("w"));
+    if (Ctx->TraceFile == NULL){
+        PrintError(TEXT("Unable to open trace file '%s'\n"), Ctx->TraceFileName);
+        Fatal();
     }
-    khint_t k2 = kh_get_fn(fnCRC2, 1, &doCalc2);
-    if (!doCalc2) {
-        chk2 = kh_value(FilenameSet, k2);
-        if (chk2.Crc == 0) doCalc2 = 1;
+    QueryPerformanceCounter(&Now);
+    Ctx->TraceStart = Now.QuadPart;
+    _ftprintf(Ctx->TraceFile, TEXT("[\n"));
+}
+
+//--------------------------------------------------------------------------
+// Write what is left of the events, and names for the threads.  Called once
+// the read threads are done.
+//--------------------------------------------------------------------------
+static void CloseTrace(void)
+{
+    int Slot;
+
+    for (Slot = 0; Slot < TIMING_SLOTS; Slot++){
+        if (Ctx->TraceEvents[Slot] == NULL) continue;
+        FlushTrace(Slot);
+        free(Ctx->TraceEvents[Slot]);
+        Ctx->TraceEvents[Slot] = NULL;
+        if (Slot == 0){
+            _ftprintf(Ctx->TraceFile, TEXT("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":0,\"args\":{\"name\":\"main\"}}"),
+                Ctx->TraceWritten++ ? TEXT(",\n") : TEXT(""));
+        }else{
+            _ftprintf(Ctx->TraceFile, TEXT("%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,\"args\":{\"name\":\"read %d\"}}"),
+                Ctx->TraceWritten++ ? TEXT(",\n") : TEXT(""), Slot, Slot);
+        }
     }
+    _ftprintf(Ctx->TraceFile, TEXT("\n]\n"));
+    fclose(Ctx->TraceFile);
+    Ctx->TraceFile = NULL;
+}
 
-    if (doCalc1 || doCalc2)
-    {
-        if (doCalc1 && !ReadFileAndCalculateCRC(ThisFile.FileName, ThisFile.FileSize, &chk1)) return 0;
-        if (doCalc2 && !ReadFileAndCalculateCRC(DupeOf.FileName, DupeOf.FileSize, &chk2)) return 0;
+LONGLONG TimerStart(void)
+{
+    LARGE_INTEGER Now;
+    if (!Ctx->TimersOn) return 0;
+    QueryPerformanceCounter(&Now);
+    return Now.QuadPart;
+}
 
-        if (doCalc1) kh_value(FilenameSet, k1) = chk1;
-        if (doCalc2) kh_value(FilenameSet, k2) = chk2;
-    }
-    //if (!doCalc1) chk1 = kh_value(FilenameSet, k1);
-    //if (!doCalc2) chk2 = kh_value(FilenameSet, k2);
+void TimerStop(int Stage, LONGLONG Start)
+{
+    LARGE_INTEGER Now;
+    StageTimes_t * Times;
+    UINT64 Ticks, Ns;
+    int b;
+
+    if (!Ctx->TimersOn) return;
+    QueryPerformanceCounter(&Now);
+    if (Ctx->TraceFile) TraceEvent(Stage, Start, Now.QuadPart);
+    if (!Ctx->ShowTiming) return;
+
+    Ticks = (UINT64)(Now.QuadPart - Start);
+    Ns = Ticks / Ctx->CounterFrequency * 1000000000 + Ticks % Ctx->CounterFrequency * 1000000000 / Ctx->CounterFrequency;
+
+    Times = &Ctx->StageTimes[TimingSlot][Stage];
+    Times->Count += 1;
+    Times->TotalNs += Ns;
+    if (Ns > Times->MaxNs) Times->MaxNs = Ns;
+    for (b = 0; b < TIMING_BUCKETS-1 && (Ns >> b); b++);
+    Times->Buckets[b] += 1;
+}
 
-    if (memcmp(&chk1, &chk2, sizeof(Checksum_t)) == 0) IsDuplicate = 1;
+static void InitTiming(void)
+{
+    if (Ctx->TraceFileName) OpenTrace();
+    Ctx->TimersOn = Ctx->ShowTiming || Ctx->TraceFile != NULL;
+}
 
-    if (!IsDuplicate){
-        // Full file duplicate check failed (CRC collision, or differs only after 32k)
-        return 0;
+//--------------------------------------------------------------------------
+// Print a time in nanoseconds with a unit that keeps it short.
+//--------------------------------------------------------------------------
+static const TCHAR * FormatNs(UINT64 Ns, TCHAR Buf[20])
+{
+    if (Ns < 10000){
+        _sntprintf(Buf, 20, TEXT("%lluns"), Ns);
+    }else if (Ns < 10000000){
+        _sntprintf(Buf, 20, TEXT("%lluus"), Ns / 1000);
+    }else if (Ns < (UINT64)10000000000){
+        _sntprintf(Buf, 20, TEXT("%llums"), Ns / 1000000);
+    }else{
+        _sntprintf(Buf, 20, TEXT("%llus"), Ns / 1000000000);
     }
+    return Buf;
+}
+
+//--------------------------------------------------------------------------
+// Time below which the given fraction of the calls of a stage finished,
+// as the upper end of the histogram bucket it falls into.
+//--------------------------------------------------------------------------
+static UINT64 StagePercentile(const StageTimes_t * Times, double Fraction)
+{
+    UINT64 Seen = 0;
+    int b;
 
-    DupeStats.DuplicateFiles += 1;
-    DupeStats.DuplicateBytes += (__int64)ThisFile.FileSize;
+    for (b = 0; b < TIMING_BUCKETS-1; b++){
+        Seen += Times->Buckets[b];
+        if (Seen >= Fraction * Times->Count) break;
+    }
+    if (b == TIMING_BUCKETS-1 || ((UINT64)1 << b) > Times->MaxNs) return Times->MaxNs;
+    return (UINT64)1 << b;
+}
 
-dont_read:
-    if (PrintDuplicates){
-        if (!HardlinkSearchMode){
-            ClearProgressInd();
-            if (!(Hardlinked && SkipLinkedDuplicates)) {
-                _tprintf(TEXT("Duplicate: '%s'\n"), DupeOf.FileName);
-                _tprintf(TEXT("With:      '%s'\n"), ThisFile.FileName);
-            }
-            if (Hardlinked && !SkipLinkedDuplicates) {
-                // If the files happen to be hardlinked, show that.
-                _tprintf(TEXT("    (hardlinked instances of same file)\n"));
+static void PrintTiming(void)
+{
+    StageTimes_t Sum;
+    TCHAR Buf[4][20];
+    int Stage, Slot, b;
+
+    Print(TEXT("\nStage           Calls   Total ms   Mean      p50       p99       Max\n"));
+    for (Stage = 0; Stage < NUM_STAGES; Stage++){
+        memset(&Sum, 0, sizeof(Sum));
+        for (Slot = 0; Slot < TIMING_SLOTS; Slot++){
+            StageTimes_t * Times = &Ctx->StageTimes[Slot][Stage];
+            Sum.Count += Times->Count;
+            Sum.TotalNs += Times->TotalNs;
+            if (Times->MaxNs > Sum.MaxNs) Sum.MaxNs = Times->MaxNs;
+            for (b = 0; b < TIMING_BUCKETS; b++) Sum.Buckets[b] += Times->Buckets[b];
+        }
+        if (Sum.Count == 0) continue;
+
+        Print(TEXT("%-12s %8llu %10.1f   %-9s %-9s %-9s %s\n"), StageNames[Stage], Sum.Count,
+            Sum.TotalNs / 1e6, FormatNs(Sum.TotalNs / Sum.Count, Buf[0]),
+            FormatNs(StagePercentile(&Sum, 0.5), Buf[1]), FormatNs(StagePercentile(&Sum, 0.99), Buf[2]),
+            FormatNs(Sum.MaxNs, Buf[3]));
+
+        // The histogram, one entry per bucket that was hit.
+        Print(TEXT("            "));
+        for (b = 0; b < TIMING_BUCKETS; b++){
+            if (Sum.Buckets[b] == 0) continue;
+            if (b == TIMING_BUCKETS-1){
+                Print(TEXT(" >=%s:%llu"), FormatNs((UINT64)1 << (b-1), Buf[0]), Sum.Buckets[b]);
+            }else{
+                Print(TEXT(" <%s:%llu"), FormatNs((UINT64)1 << b, Buf[0]), Sum.Buckets[b]);
             }
         }
+        Print(TEXT("\n"));
     }
+}
+
+//--------------------------------------------------------------------------
+// Ctrl+Break asks for the timing so far.  The handler runs on a thread of its
+// own, so it only counts the request for the progress thread to act on.
+//--------------------------------------------------------------------------
+static BOOL WINAPI TimingCtrlHandler(DWORD CtrlType)
+{
+    if (CtrlType != CTRL_BREAK_EVENT || TimingScans == 0) return FALSE;
+    InterlockedIncrement(&TimingRequests);
+    return TRUE;
+}
+
+static void StartTimingRequests(void)
+{
+    Ctx->TimingSeen = TimingRequests;
+    Ctx->TimingHandler = 1;
+    InterlockedIncrement(&TimingScans);
+    // Set once, it passes Ctrl+Break on while no scan is timed.
+    if (InterlockedExchange(&TimingHandlerSet, 1) == 0) SetConsoleCtrlHandler(TimingCtrlHandler, TRUE);
+}
+
+static void StopTimingRequests(void)
+{
+    if (!Ctx->TimingHandler) return;
+    Ctx->TimingHandler = 0;
+    InterlockedDecrement(&TimingScans);
+}
+
+static void PollTimingRequest(void)
+{
+    LONG Requests = TimingRequests;
+    if (!Ctx->TimingHandler || Requests == Ctx->TimingSeen) return;
+    Ctx->TimingSeen = Requests;
+    ClearProgressInd();
+    PrintTiming();
+}
+
+//--------------------------------------------------------------------------
+// Act on a duplicate: delete it, link it or write the batch file lines.
+//--------------------------------------------------------------------------
+static int ActOnDuplicate(FileData_t * ThisFile, FileData_t * DupeOf, int Hardlinked)
+{
+    int IsReadonly;
+    struct _stat64 FileStat;
 
-    if (_tstat64(ThisFile.FileName, &FileStat) != 0){
+    if (_tstat64(ThisFile->FileName, &FileStat) != 0){
         // oops!
-        _ftprintf(stderr, TEXT("stat failed on '%s'\n"), ThisFile.FileName);
-        exit (EXIT_FAILURE);
+        PrintError(TEXT("stat failed on '%s'\n"), ThisFile->FileName);
+        Fatal();
     }
     IsReadonly = (FileStat.st_mode & S_IWUSR) ? 0 : 1;
 
     if (IsReadonly){
         // Readonly file.
-        if (!DoReadonly && !Hardlinked){
+        if (!Ctx->DoReadonly && !Hardlinked){
             ClearProgressInd();
-            _tprintf(TEXT("Skipping duplicate readonly file '%s'\n"), ThisFile.FileName);
+            Print(TEXT("Skipping duplicate readonly file '%s'\n"), ThisFile->FileName);
             return 1;
         }
-        if (MakeHardLinks || DelDuplicates){
+        if (Ctx->MakeHardLinks || Ctx->DelDuplicates){
             // Make file read/write so we can delete it.
             // We sort of assume we own the file.  Otherwise, not much we can do.
-            _tchmod(ThisFile.FileName, FileStat.st_mode | S_IWUSR);
+            _tchmod(ThisFile->FileName, FileStat.st_mode | S_IWUSR);
         }
     }
 
-    if (BatchFile){
+    if (Ctx->BatchFile){
         // put command in batch file
-        if (DelDuplicates || !Hardlinked)
-            ftprintf(BatchFile, TEXT("del %s\"%s\"\n"), (IsReadonly ? TEXT("/F ") : TEXT("")),
-                EscapeBatchName(ThisFile.FileName));
-        if (!DelDuplicates){
+        if (Ctx->DelDuplicates || !Hardlinked)
+            ftprintf(Ctx->BatchFile, TEXT("del %s\"%s\"\n"), (IsReadonly ? TEXT("/F ") : TEXT("")),
+                EscapeBatchName(ThisFile->FileName));
+        if (!Ctx->DelDuplicates){
             if (!Hardlinked){
-                ftprintf(BatchFile, TEXT("fsutil hardlink create \"%s\" \"%s\"\n"),
-                    ThisFile.FileName, DupeOf.FileName);
+                ftprintf(Ctx->BatchFile, TEXT("fsutil hardlink create \"%s\" \"%s\"\n"),
+                    ThisFile->FileName, DupeOf->FileName);
                 if (IsReadonly){
                     // If original was readonly, restore that attribute
-                    ftprintf(BatchFile, TEXT("attrib +r \"%s\"\n"), ThisFile.FileName);
+                    ftprintf(Ctx->BatchFile, TEXT("attrib +r \"%s\"\n"), ThisFile->FileName);
                 }
             }
         }else{
-            ftprintf(BatchFile, TEXT("rem duplicate of \"%s\"\n"), DupeOf.FileName);
+            ftprintf(Ctx->BatchFile, TEXT("rem duplicate of \"%s\"\n"), DupeOf->FileName);
         }
 
-    }else if (MakeHardLinks || DelDuplicates){
-        if (MakeHardLinks && Hardlinked) return 0; // Nothign to do.
+    }else if (Ctx->MakeHardLinks || Ctx->DelDuplicates){
+        if (Ctx->MakeHardLinks && Hardlinked) return 0; // Nothign to do.
 
-        if (_tunlink(ThisFile.FileName)){
+        if (_tunlink(ThisFile->FileName)){
             ClearProgressInd();
-            _ftprintf(stderr, TEXT("Delete of '%s' failed\n"), DupeOf.FileName);
-            exit (EXIT_FAILURE);
+            PrintError(TEXT("Delete of '%s' failed\n"), DupeOf->FileName);
+            Fatal();
         }
-        if (MakeHardLinks){
-            if (CreateHardLink(ThisFile.FileName, DupeOf.FileName, NULL) == 0){
+        if (Ctx->MakeHardLinks){
+            if (CreateHardLink(ThisFile->FileName, DupeOf->FileName, NULL) == 0){
                 // Uh-oh.  Better stop before we mess up more stuff!
                 ClearProgressInd();
-                _ftprintf(stderr, TEXT("Create hard link from '%s' to '%s' failed\n"),
-                        DupeOf.FileName, ThisFile.FileName);
-                exit(EXIT_FAILURE);
+                PrintError(TEXT("Create hard link from '%s' to '%s' failed\n"),
+                        DupeOf->FileName, ThisFile->FileName);
+                Fatal();
             }
 
             {
                 // set Unix access rights and time to new file
                 struct _utimbuf mtime;
-                _tchmod(ThisFile.FileName, FileStat.st_mode);
+                _tchmod(ThisFile->FileName, FileStat.st_mode);
 
                 // Set mod time to original file's
                 mtime.actime = FileStat.st_mtime;
                 mtime.modtime = FileStat.st_mtime;
             
-                _tutime(ThisFile.FileName, &mtime);
+                _tutime(ThisFile->FileName, &mtime);
             }
+            if (!Ctx->OnGroup){
+                ClearProgressInd();
+                Print(TEXT("    Created hardlink\n"));
+            }
+        }else if (!Ctx->OnGroup){
             ClearProgressInd();
-            _tprintf(TEXT("    Created hardlink\n"));
-        }else{
-            ClearProgressInd();
-            _tprintf(TEXT("    Deleted duplicate\n"));
+            Print(TEXT("    Deleted duplicate\n"));
         }
     }
     return 2;
 }
 
-static int ReadFileAndCalculateCRC(TCHAR* fileName, UINT64 fileSize, Checksum_t* checksum)
+//--------------------------------------------------------------------------
+// Eliminate duplicates.
+//--------------------------------------------------------------------------
+static int EliminateDuplicate(FileData_t * ThisFile, FileData_t * DupeOf, int Hardlinked)
 {
-    #define CHUNK_SIZE 0x10000
-    FILE * File;
-    UINT64 BytesLeft;
-    size_t BytesToRead;
-    char Buf[CHUNK_SIZE];
-    int IsError = 0;
+    // Files are known to be equal here, act on the duplicate.
+    LONGLONG Start;
+    int Result;
 
-    File = _tfopen(fileName, TEXT("rb"));
-    if (File == NULL) {
-        return 0;
+    if (!Hardlinked){
+        Ctx->DupeStats.DuplicateFiles += 1;
+        Ctx->DupeStats.DuplicateBytes += (__int64)ThisFile->FileSize;
     }
-    memset(checksum, 0, sizeof(Checksum_t));
-
-    BytesLeft = fileSize;
-
-    while (BytesLeft) {
-        BytesToRead = (BytesLeft > CHUNK_SIZE) ? CHUNK_SIZE : BytesLeft;
 
-        if (fread(Buf, 1, BytesToRead, File) != BytesToRead) {
+    if (Ctx->PrintDuplicates && !Ctx->OnGroup){
+        if (!Ctx->HardlinkSearchMode){
+            Start = TimerStart();
             ClearProgressInd();
-            _ftprintf(stderr, TEXT("Error doing full file read on '%s'\n"), fileName);
-            IsError = 1;
-            break;
+            if (!(Hardlinked && Ctx->SkipLinkedDuplicates)) {
+                Print(TEXT("Duplicate: '%s'\n"), DupeOf->FileName);
+                Print(TEXT("With:      '%s'\n"), ThisFile->FileName);
+            }
+            if (Hardlinked && !Ctx->SkipLinkedDuplicates) {
+                // If the files happen to be hardlinked, show that.
+                Print(TEXT("    (hardlinked instances of same file)\n"));
+            }
+            TimerStop(STAGE_OUTPUT, Start);
         }
-
-        CalcCrc(checksum, Buf, BytesToRead);
-
-        BytesLeft -= BytesToRead;
     }
 
-    fclose(File);
-    
-    return !IsError;
+    Start = TimerStart();
+    Result = ActOnDuplicate(ThisFile, DupeOf, Hardlinked);
+    TimerStop(STAGE_ACTION, Start);
+    return Result;
 }
 
-#ifdef REF_CODE
-static int IsNonRefPath(TCHAR * filename)
-{
-    int i;
-    TCHAR * cmpPath;
-        
-    i = _tcslen(filename)-1;
-    for (i; i >= 0; i--)
-    {
-        if ((int)filename[i] == (int)'\\') break;
-    }
+//--------------------------------------------------------------------------
+// Read limits: token buckets for bytes read and files opened per second,
+// taken from by every read and open.  A taker that overdraws the bucket
+// sleeps until the debt is paid off.  Limits can be changed while running
+// via the control file.
+//--------------------------------------------------------------------------
+#ifndef THREAD_MODE_BACKGROUND_BEGIN
+#define THREAD_MODE_BACKGROUND_BEGIN 0x00010000
+#endif
+#ifndef THREAD_MODE_BACKGROUND_END
+#define THREAD_MODE_BACKGROUND_END   0x00020000
+#endif
 
-    if (i == 0)
-    {
-        _ftprintf(stderr, TEXT("IsNonRefPath, path without any slash!?"));
-        exit(EXIT_FAILURE);
-    }
+static void TakeTokens(TokenBucket_t * Bucket, double Amount)
+{
+    LARGE_INTEGER Now;
+    DWORD Wait = 0;
 
-    cmpPath = (TCHAR*) malloc(sizeof(TCHAR) * (i+2));
-    _tcsncpy(cmpPath, filename, i+1);
-    cmpPath[i+1] = '\0';
+    if (Bucket->Rate <= 0) return;
 
-    for (i = 0; i < PathUnique; i++)
-    {
-        if (_tcscmp(cmpPath, PathData[i]) == 0) {
-            free(cmpPath);
-            return 0;
+    EnterCriticalSection(&Ctx->ThrottleLock);
+    if (Bucket->Rate > 0){
+        QueryPerformanceCounter(&Now);
+        if (Bucket->Last){
+            Bucket->Tokens += (double)(Now.QuadPart - Bucket->Last) / Ctx->CounterFrequency * Bucket->Rate;
+        }else{
+            Bucket->Tokens = Bucket->Rate;
         }
+        Bucket->Last = Now.QuadPart;
+        if (Bucket->Tokens > Bucket->Rate) Bucket->Tokens = Bucket->Rate; // Bursts up to one second.
+
+        Bucket->Tokens -= Amount;
+        if (Bucket->Tokens < 0) Wait = (DWORD)(-Bucket->Tokens * 1000 / Bucket->Rate);
     }
-    free(cmpPath);
+    LeaveCriticalSection(&Ctx->ThrottleLock);
 
-    return 1;
+    if (Wait) Sleep(Wait);
 }
-#endif
 
-static void StoreFileData(FileData_t ThisFile, INT64 filenameCRC)
+static void SetLimit(TokenBucket_t * Bucket, double Rate)
 {
-    int currentIndex = NumUnique % UNITS_PER_ALLOCATION;
-
-    if (NumUnique >= NumAllocated) {
-        // Box is full, make a new one
-        NumAllocated += UNITS_PER_ALLOCATION;
-        FileData = (FileData_t*)malloc(sizeof(FileData_t) * UNITS_PER_ALLOCATION);
-        if (FileData == NULL) {
-            _ftprintf(stderr, TEXT("Malloc failure"));
-            exit(EXIT_FAILURE);
-        }
-    }
-    FileData[currentIndex] = ThisFile;
-    NumUnique += 1;
-
-    int found;
-    khiter_t k = kh_get_fd(ThisFile.FileSize, 1, &found);
-    if (!found)
-        kh_value(FileDataMap, k) = &FileData[currentIndex];
-
-    if (filenameCRC == 0)
-        filenameCRC = CalcFilenameCRC(ThisFile.FileName);
-
-    kh_put_fn(filenameCRC);
+    EnterCriticalSection(&Ctx->ThrottleLock);
+    Bucket->Rate = Rate;
+    Bucket->Last = 0;
+    LeaveCriticalSection(&Ctx->ThrottleLock);
 }
 
 //--------------------------------------------------------------------------
-// Check for duplicates.
+// Read the control file again if it changed.  Lines are maxmb=<MB/s> and
+// maxopen=<files/s>, 0 for no limit.
 //--------------------------------------------------------------------------
-static void CheckDuplicate(FileData_t *Ptr, FileData_t ThisFile, INT64 filenameCRC)
+static void PollControlFile(void)
 {
-    FileData_t *prevPtr = NULL;
-    FileData_t * *Link;
-    // Find where in the tree structure it belongs.
-    //Ptr = 0;
+    struct _stat64 FileStat;
+    TCHAR Line[100];
+    FILE * File;
+    DWORD Now = GetTickCount();
 
-    if (MeasureDurations) ticksCheck = GetTickCount();
+    if (Ctx->ControlFileName == NULL || (unsigned)(Now - Ctx->ControlPoll) < 1000) return;
+    Ctx->ControlPoll = Now;
 
-    if (NumUnique == 0 || Ptr == NULL) goto store_it;
+    if (_tstat64(Ctx->ControlFileName, &FileStat) != 0 || FileStat.st_mtime == Ctx->ControlChange) return;
+    Ctx->ControlChange = FileStat.st_mtime;
 
-    /*
-    int found;
-    khiter_t k = kh_get_fd(ThisFile.FileSize, 0, &found);
-    if (found)
-        Ptr = kh_value(FileDataMap, k);
-    else
-        goto store_it;
-    */
-
-    int comp = 0, oldComp;
-    for (;;) {
-        oldComp = comp;
-        comp = memcmp(&ThisFile.Checksum, &Ptr->Checksum, sizeof(Checksum_t));
-        if (comp == 0) {
-            // the same file
-            if (_tcscmp(ThisFile.FileName, Ptr->FileName) == 0) {
-                if (MeasureDurations) { ticksCheck = GetTickCount() - ticksCheck; totalCheck += ticksCheck; }
-                return;
-            }
-            // Check for true duplicate.
-            #ifdef REF_CODE
-            if (!ReferenceFiles && !HardlinkSearchMode && IsNonRefPath(ThisFile.FileName)) {
-            #else
-            if (!ReferenceFiles && !HardlinkSearchMode) {
-            #endif
-                int r = EliminateDuplicate(ThisFile, *Ptr);
-                if (r) {
-                    if (r == 2) Ptr->NumLinks += 1; // Update link count.
-                    // Its a duplicate for elimination.  Do not store info on it. New: store info for correct statistic calculation
-                    goto store_it;
-                }
-            }
-            // Build a chain on one side of the branch.
-            // That way, we will check every checksum collision from here on.
-            // Mark that we are on chain with equal checksums
-            comp = 2;
-        }
-        else if (oldComp == 2) {
-            // Insert it at the chain end before the next higher checksum so that the branch keeps sorted
-            comp = 3;
-        }
-
-        if (comp) {
-            if (comp > 0) {
-                if (comp == 3)
-                {
-                    prevPtr->Larger = FileData + (NumUnique % UNITS_PER_ALLOCATION);
-                    ThisFile.Larger = Ptr;
-                    break;
-                }
-                else
-                    Link = &Ptr->Larger;
-            }
-            else {
-                Link = &Ptr->Smaller;
-            }
-            if (*Link == NULL) {
-                // Link it to here.
-                *Link = FileData + (NumUnique % UNITS_PER_ALLOCATION);
-                break;
-            } else {
-                prevPtr = Ptr;
-                Ptr = *Link;
-            }
+    File = _tfopen(Ctx->ControlFileName, TEXT("r"));
+    if (File == NULL) return;
+    while (_fgetts(Line, 100, File)){
+        if (!_tcsncmp(Line, TEXT("maxmb="), 6)){
+            SetLimit(&Ctx->ReadBytesLimit, _tstof(Line + 6) * 1024 * 1024);
+        }else if (!_tcsncmp(Line, TEXT("maxopen="), 8)){
+            SetLimit(&Ctx->OpensLimit, _tstof(Line + 8));
         }
     }
+    fclose(File);
+}
 
-    store_it:
+//--------------------------------------------------------------------------
+// Cache hints for the full compare, so a scan neither pushes the working set
+// of other programs out of the file cache nor waits on reads that could have
+// been started earlier:
+//   seq       open with FILE_FLAG_SEQUENTIAL_SCAN, for more read-ahead
+//   prefetch  each read thread starts reading the head of its next file
+//             while it works on the one before (ReadAhead_t)
+//   drop      read with very low memory priority, and purge the cached data
+//             of each file once it has been read whole (DropFromCache)
+// Memory priority exists from Windows 8 on, so it is looked up at run time.
+//--------------------------------------------------------------------------
+#define CACHE_SEQUENTIAL 1
+#define CACHE_PREFETCH   2
+#define CACHE_DROP       4
 
-    if (MeasureDurations) { ticksCheck = GetTickCount() - ticksCheck; totalCheck += ticksCheck; }
+#define THREAD_MEMORY_PRIORITY  0   // ThreadMemoryPriority
+#define MEMORY_PRIORITY_LOWEST  1   // MEMORY_PRIORITY_VERY_LOW
+#define MEMORY_PRIORITY_DEFAULT 5   // MEMORY_PRIORITY_NORMAL
 
-    DupeStats.TotalFiles += 1;
-    DupeStats.TotalBytes += (__int64)ThisFile.FileSize;
+static void InitCacheHints(void)
+{
+    HMODULE Kernel = GetModuleHandle(TEXT("kernel32.dll"));
+    Ctx->SetThreadInformationFunc = (SetThreadInformation_t)GetProcAddress(Kernel, "SetThreadInformation");
+}
 
-    StoreFileData(ThisFile, filenameCRC);
+static void SetMemoryPriority(ULONG Priority)
+{
+    if ((Ctx->CacheHints & CACHE_DROP) && Ctx->SetThreadInformationFunc){
+        Ctx->SetThreadInformationFunc(GetCurrentThread(), THREAD_MEMORY_PRIORITY, &Priority, sizeof(Priority));
+    }
 }
 
+#ifdef REF_CODE
 //--------------------------------------------------------------------------
-// Walk the file tree after handling detect mode to show linked groups.
+// Remember a directory matched by a -ref pattern (called from myglob)
 //--------------------------------------------------------------------------
-static void WalkTree(FileData_t *item, FileData_t *linksFirst, int groupLen)
+void AddRefPath(const TCHAR * Path)
 {
-    int a;
-    FileData_t *t;
+    int ret;
+    TCHAR * refpath;
 
-    if (NumUnique == 0) return;
+    if (!Ctx->ReferenceFiles) return;
+    if (kh_get(refdir, Ctx->RefDirSet, Path) != kh_end(Ctx->RefDirSet)) return;
 
-    if (item->Larger != NULL) {
-        FileData_t *larger = item->Larger;
-        if (memcmp(&larger->Checksum, &item->Checksum, sizeof(Checksum_t)) == 0) {
-            // it continues the same group.
-            WalkTree(item->Larger, linksFirst != NULL ? linksFirst : item, groupLen + 1);
-            goto not_end;
-        }
-        else {
-            WalkTree(item->Larger, NULL, 0);
-        }
-    }
-    _tprintf(TEXT("\nHardlink group, %d of %d hardlinked instances found in search tree:\n"), groupLen + 1, item->NumLinks);
-    t = linksFirst != NULL ? linksFirst : item;
-    for (a = 0; a <= groupLen; a++) {
-        _tprintf(TEXT("  \"%s\"\n"), t->FileName);
-        t = t->Larger;
+    refpath = _tcsdup(Path);
+    if (refpath == NULL){
+        PrintError(TEXT("Malloc failure"));
+        Fatal();
     }
-
-    DupeStats.HardlinkGroups += 1;
-
-not_end:
-    if (item->Smaller != NULL) {
-        WalkTree(item->Smaller, NULL, 0);
+    kh_put(refdir, Ctx->RefDirSet, refpath, &ret);
+    if (ret == -1) {
+        PrintError(TEXT("error storing new reference path"));
+        Fatal();
     }
 }
 
-Checksum_t ReadFileAndCalculateCRC32KB(HANDLE FileHandle, const TCHAR* FileName, UINT64 FileSize)
+static int IsNonRefPath(const TCHAR * filename)
 {
-    Checksum_t CheckSum;
-    char FileBuffer[BYTES_DO_CHECKSUM_OF];
-    unsigned BytesRead, BytesToRead;
-    memset(&CheckSum, 0, sizeof(CheckSum));
+    int i;
+    TCHAR cmpPath[_MAX_PATH*2];
 
-    int ticksByteRead, ticksCRC;
-    if (MeasureDurations) ticksByteRead = GetTickCount();
+    if (kh_size(Ctx->RefDirSet) == 0) return 1;
 
-    BytesToRead = (FileSize > BYTES_DO_CHECKSUM_OF) ? BYTES_DO_CHECKSUM_OF : FileSize;
-    BOOL ret = ReadFile(FileHandle, FileBuffer, BytesToRead, &BytesRead, NULL);
-    if (!ret) {
-        if (!HideCantReadMessage) {
-            ClearProgressInd();
-            _ftprintf(stderr, TEXT("file read problem on '%s'\n"), FileName);
-        }
-        CloseHandle(FileHandle);
-        return;
+    i = _tcslen(filename)-1;
+    for (i; i >= 0; i--)
+    {
+        if ((int)filename[i] == (int)'\\') break;
+    }
+
+    if (i == 0)
+    {
+        PrintError(TEXT("IsNonRefPath, path without any slash!?"));
+        Fatal();
+    }
+    // Too long to look up: treat as a reference, so it is never deleted or linked
+    if (i+1 >= _MAX_PATH*2) return 0;
+
+    // Directory part including the trailing backslash, as stored by AddRefPath
+    _tcsncpy(cmpPath, filename, i+1);
+    cmpPath[i+1] = '\0';
+
+    return kh_get(refdir, Ctx->RefDirSet, cmpPath) == kh_end(Ctx->RefDirSet);
+}
+#endif
+
+//--------------------------------------------------------------------------
+// Check if a directory name matches one of the -ign-dir patterns, and count
+// it as pruned (called from myglob)
+//--------------------------------------------------------------------------
+int IsIgnoredDir(const TCHAR * DirName)
+{
+    int a;
+    for (a=0;a<Ctx->IgnoreDirPatternsCount;a++){
+        if (PathMatchSpec(DirName, Ctx->IgnoreDirPatterns[a])){
+            Ctx->DupeStats.IgnoredDirs += 1;
+            return TRUE;
+        }
+    }
+    return FALSE;
+}
+
+//--------------------------------------------------------------------------
+// Out of memory listing a directory, gives up on the scan (called from myglob)
+//--------------------------------------------------------------------------
+void GlobNoMemory(void)
+{
+    PrintError(TEXT("Malloc failure"));
+    Fatal();
+}
+
+static FileData_t * NewFileData(FileData_t ThisFile)
+{
+    int currentIndex = Ctx->NumUnique % UNITS_PER_ALLOCATION;
+
+    if (Ctx->NumUnique >= Ctx->NumAllocated) {
+        // Box is full, make a new one
+        Ctx->NumAllocated += UNITS_PER_ALLOCATION;
+        Ctx->FileData = (FileData_t*)malloc(sizeof(FileData_t) * UNITS_PER_ALLOCATION);
+        if (Ctx->FileData == NULL) {
+            PrintError(TEXT("Malloc failure"));
+            Fatal();
+        }
+        Ctx->FileDataBlocks = GrowArray(Ctx->FileDataBlocks, &Ctx->FileDataBlocksAlloc, Ctx->NumFileDataBlocks+1, sizeof(FileData_t*));
+        Ctx->FileDataBlocks[Ctx->NumFileDataBlocks++] = Ctx->FileData;
+    }
+    Ctx->FileData[currentIndex] = ThisFile;
+    Ctx->NumUnique += 1;
+    return &Ctx->FileData[currentIndex];
+}
+
+//--------------------------------------------------------------------------
+// Copy a file name into the name blocks of the scan.  Saves a malloc per
+// file, and the names go in one piece with the scan.
+//--------------------------------------------------------------------------
+#define NAME_BLOCK_CHARS 65536
+
+static TCHAR * KeepName(const TCHAR * Name)
+{
+    size_t Len = _tcslen(Name) + 1;
+    TCHAR * Kept;
+
+    if (Len > Ctx->NameBlockLeft){
+        size_t Chars = (Len > NAME_BLOCK_CHARS) ? Len : NAME_BLOCK_CHARS;
+        Ctx->NameBlocks = GrowArray(Ctx->NameBlocks, &Ctx->NameBlocksAlloc, Ctx->NumNameBlocks+1, sizeof(TCHAR*));
+        Ctx->NameBlock = (TCHAR *)malloc(Chars * sizeof(TCHAR));
+        if (Ctx->NameBlock == NULL){
+            PrintError(TEXT("Malloc failure"));
+            Fatal();
+        }
+        Ctx->NameBlocks[Ctx->NumNameBlocks++] = Ctx->NameBlock;
+        Ctx->NameBlockLeft = Chars;
+    }
+    Kept = Ctx->NameBlock;
+    memcpy(Kept, Name, Len * sizeof(TCHAR));
+    Ctx->NameBlock += Len;
+    Ctx->NameBlockLeft -= Len;
+    return Kept;
+}
+
+//--------------------------------------------------------------------------
+// Read buffers.  Page aligned, as reads that bypass the file cache need, and
+// kept for reuse.  At most one is in use per thread.
+//--------------------------------------------------------------------------
+#define READ_BUFFER_SIZE (256 * 1024)
+#define READ_ALIGN       4096   // Covers sector sizes up to 4k
+
+static char * GetReadBuffer(void)
+{
+    char * Buffer = NULL;
+
+    EnterCriticalSection(&Ctx->BufferLock);
+    if (Ctx->NumFreeBuffers) Buffer = Ctx->FreeBuffers[--Ctx->NumFreeBuffers];
+    LeaveCriticalSection(&Ctx->BufferLock);
+
+    if (Buffer == NULL){
+        Buffer = (char *)VirtualAlloc(NULL, READ_BUFFER_SIZE, MEM_COMMIT | MEM_RESERVE, PAGE_READWRITE);
+        if (Buffer == NULL){
+            PrintError(TEXT("Malloc failure"));
+            Fatal();
+        }
+    }
+    return Buffer;
+}
+
+static void PutReadBuffer(char * Buffer)
+{
+    EnterCriticalSection(&Ctx->BufferLock);
+    if (Ctx->NumFreeBuffers < MAXIMUM_WAIT_OBJECTS + 1){
+        Ctx->FreeBuffers[Ctx->NumFreeBuffers++] = Buffer;
+        Buffer = NULL;
+    }
+    LeaveCriticalSection(&Ctx->BufferLock);
+    if (Buffer) VirtualFree(Buffer, 0, MEM_RELEASE);
+}
+
+//--------------------------------------------------------------------------
+// Bytes to read for the next Length bytes of a range, Skip bytes behind an
+// aligned offset.
+//--------------------------------------------------------------------------
+static DWORD ReadChunk(DWORD Skip, UINT64 Length)
+{
+    if (Skip + Length >= READ_BUFFER_SIZE) return READ_BUFFER_SIZE;
+    return (DWORD)(Skip + Length + READ_ALIGN - 1) & ~(DWORD)(READ_ALIGN - 1);
+}
+
+//--------------------------------------------------------------------------
+// Wait for a read.  The end of the file reads as 0 bytes, as it does for a
+// read without OVERLAPPED.
+//--------------------------------------------------------------------------
+static BOOL WaitRead(HANDLE FileHandle, OVERLAPPED * Overlapped, DWORD * BytesRead)
+{
+    if (GetOverlappedResult(FileHandle, Overlapped, BytesRead, TRUE)) return TRUE;
+    *BytesRead = 0;
+    return GetLastError() == ERROR_HANDLE_EOF;
+}
+
+//--------------------------------------------------------------------------
+// Read at an offset.  The offset goes in an OVERLAPPED, so this serves
+// handles opened with and without FILE_FLAG_OVERLAPPED.
+//--------------------------------------------------------------------------
+static BOOL ReadAt(HANDLE FileHandle, UINT64 Pos, char * Buffer, DWORD BytesToRead, DWORD * BytesRead)
+{
+    OVERLAPPED Overlapped;
+
+    memset(&Overlapped, 0, sizeof(Overlapped));
+    Overlapped.Offset = (DWORD)Pos;
+    Overlapped.OffsetHigh = (DWORD)(Pos >> 32);
+    if (ReadFile(FileHandle, Buffer, BytesToRead, BytesRead, &Overlapped)) return TRUE;
+    if (GetLastError() == ERROR_IO_PENDING) return WaitRead(FileHandle, &Overlapped, BytesRead);
+    *BytesRead = 0;
+    return GetLastError() == ERROR_HANDLE_EOF;
+}
+
+//--------------------------------------------------------------------------
+// Add a range of a file to a checksum.  Reads always start on an aligned
+// offset and are whole multiples of READ_ALIGN, so the same code serves
+// handles opened with and without FILE_FLAG_NO_BUFFERING.  With Ahead, the
+// first read was started already, by StartReadAhead.
+//--------------------------------------------------------------------------
+static BOOL ReadRangeCrc(HANDLE FileHandle, UINT64 Offset, UINT64 Length, Checksum_t * CheckSum, ReadAhead_t * Ahead)
+{
+    char * FileBuffer;
+    DWORD BytesRead, Skip, Use;
+    UINT64 Pos;
+    LONGLONG Start;
+    BOOL Ok = TRUE, Read;
+    int OwnBuffer = Ahead == NULL;
+
+    Pos = Offset & ~(UINT64)(READ_ALIGN - 1);
+    Skip = (DWORD)(Offset - Pos);
+
+    FileBuffer = Ahead ? Ahead->Buffer : GetReadBuffer();
+    while (Length) {
+        if (Ahead){
+            Start = TimerStart();
+            Read = WaitRead(FileHandle, &Ahead->Overlapped, &BytesRead);
+            Ahead = NULL;
+        }else{
+            DWORD BytesToRead = ReadChunk(Skip, Length);
+            TakeTokens(&Ctx->ReadBytesLimit, (double)BytesToRead);
+            Start = TimerStart();
+            Read = ReadAt(FileHandle, Pos, FileBuffer, BytesToRead, &BytesRead);
+        }
+        if (!Read) {
+            Ok = FALSE;
+            break;
+        }
+        TimerStop(Ctx->ReadStage, Start);
+        Pos += BytesRead;
+        Ctx->IoCounts[TimingSlot].BytesRead += BytesRead;
+        if (BytesRead <= Skip) {
+            Ok = FALSE; // File got shorter meanwhile.
+            break;
+        }
+        Use = BytesRead - Skip;
+        if (Use > Length) Use = (DWORD)Length;
+        Start = TimerStart();
+        CalcCrc(CheckSum, FileBuffer + Skip, Use);
+        TimerStop(STAGE_HASH, Start);
+        Ctx->IoCounts[TimingSlot].BytesHashed += Use;
+        Length -= Use;
+        Skip = 0;
+    }
+    if (Ahead){
+        // Not used, but the buffer is written to until the read is done.
+        WaitRead(FileHandle, &Ahead->Overlapped, &BytesRead);
+    }
+    if (OwnBuffer) PutReadBuffer(FileBuffer); // Else the read thread's
+    return Ok;
+}
+
+static int SizeClass(UINT64 FileSize)
+{
+    int c = 0;
+    while (FileSize >>= 1) c++;
+    return c;
+}
+
+static int IsAdaptivePrefix(const Tier_t * Tier)
+{
+    return Tier == &Ctx->Tiers[0] && Tier->Kind == TIER_HEAD;
+}
+
+//--------------------------------------------------------------------------
+// Length of the range (or of each block) one tier reads of a file.
+//--------------------------------------------------------------------------
+static UINT64 TierLength(const Tier_t * Tier, UINT64 FileSize)
+{
+    UINT64 Length = IsAdaptivePrefix(Tier) ? Ctx->PrefixBytes[SizeClass(FileSize)] : Tier->Bytes;
+    return (Length > FileSize) ? FileSize : Length;
+}
+
+//--------------------------------------------------------------------------
+// Number of bytes one tier reads of a file.
+//--------------------------------------------------------------------------
+static UINT64 TierBytes(const Tier_t * Tier, UINT64 FileSize)
+{
+    UINT64 Length = TierLength(Tier, FileSize);
+    return (Tier->Kind == TIER_SAMPLE) ? Length * Tier->Blocks : Length;
+}
+
+//--------------------------------------------------------------------------
+// Whether one of the first NumDone tiers read files of this size whole.
+//--------------------------------------------------------------------------
+static int CoveredByTiers(int NumDone, UINT64 FileSize)
+{
+    int t;
+    for (t = 0; t < NumDone; t++){
+        if (TierLength(&Ctx->Tiers[t], FileSize) >= FileSize) return 1;
+    }
+    return 0;
+}
+
+//--------------------------------------------------------------------------
+// Calculate the signature of a file for one comparison tier.
+//--------------------------------------------------------------------------
+static BOOL ReadTierChecksum(HANDLE FileHandle, const Tier_t * Tier, UINT64 FileSize, Checksum_t * CheckSum)
+{
+    UINT64 Length = TierLength(Tier, FileSize);
+    int b;
+    memset(CheckSum, 0, sizeof(Checksum_t));
+
+    switch (Tier->Kind) {
+        case TIER_HEAD:
+            if (!ReadRangeCrc(FileHandle, 0, Length, CheckSum, NULL)) return FALSE;
+            break;
+        case TIER_TAIL:
+            if (!ReadRangeCrc(FileHandle, FileSize - Length, Length, CheckSum, NULL)) return FALSE;
+            break;
+        case TIER_SAMPLE:
+            // Blocks spread evenly between head and tail.
+            for (b = 1; b <= Tier->Blocks; b++) {
+                UINT64 Offset = (FileSize - Length) / (Tier->Blocks + 1) * b;
+                if (!ReadRangeCrc(FileHandle, Offset, Length, CheckSum, NULL)) return FALSE;
+            }
+            break;
+    }
+
+    CheckSum->Sum += (unsigned)FileSize;
+    return TRUE;
+}
+
+static void CantReadFile(const TCHAR* FileName)
+{
+    Ctx->DupeStats.CantReadFiles += 1;
+    if (!Ctx->HideCantReadMessage) {
+        ClearProgressInd();
+        PrintError(TEXT("Could not read '%s'\n"), FileName);
+    }
+}
+
+static HANDLE OpenForRead(const TCHAR* FileName, DWORD Flags)
+{
+    HANDLE FileHandle;
+    LONGLONG Start;
+
+    TakeTokens(&Ctx->OpensLimit, 1);
+    Start = TimerStart();
+    FileHandle = CreateFile(FileName,
+        GENERIC_READ,         // dwDesiredAccess
+        FILE_SHARE_READ,      // dwShareMode
+        NULL,                 // Security attributes
+        OPEN_EXISTING,        // dwCreationDisposition
+        FILE_ATTRIBUTE_NORMAL | Flags,// dwFlagsAndAttributes.  Attributes ignored for existing files
+        NULL);                // hTemplateFile.  Ignored for existing.
+    TimerStop(STAGE_OPEN, Start);
+    return FileHandle;
+}
+
+//--------------------------------------------------------------------------
+// Open a file to read its data.  With -direct the file cache is bypassed,
+// unless the file system does not allow that.
+//--------------------------------------------------------------------------
+static HANDLE OpenForData(const TCHAR* FileName, DWORD Flags)
+{
+    HANDLE FileHandle;
+
+    if (Ctx->DirectIO) {
+        FileHandle = OpenForRead(FileName, Flags | FILE_FLAG_NO_BUFFERING);
+        if (FileHandle != INVALID_HANDLE_VALUE || GetLastError() != ERROR_INVALID_PARAMETER) return FileHandle;
+    }
+    return OpenForRead(FileName, Flags);
+}
+
+static DWORD FullReadFlags(void)
+{
+    return (Ctx->CacheHints & CACHE_SEQUENTIAL) ? FILE_FLAG_SEQUENTIAL_SCAN : 0;
+}
+
+//--------------------------------------------------------------------------
+// Have the cache manager purge the cached data of a file that was read
+// whole (-cache drop).  Opening a file without buffering does that, as long
+// as no other program has it mapped.
+//--------------------------------------------------------------------------
+static void DropFromCache(const TCHAR * FileName)
+{
+    HANDLE FileHandle;
+
+    if (!(Ctx->CacheHints & CACHE_DROP) || Ctx->DirectIO) return;
+    FileHandle = OpenForRead(FileName, FILE_FLAG_NO_BUFFERING);
+    if (FileHandle != INVALID_HANDLE_VALUE) CloseHandle(FileHandle);
+}
+
+//--------------------------------------------------------------------------
+// Calculate the checksum of a whole file.  Returns 0 if the file could not be
+// opened or read, the caller reports it.  With Ahead, the file was opened and
+// its head is being read already.
+//--------------------------------------------------------------------------
+static int ReadFileAndCalculateCRC(TCHAR* fileName, UINT64 fileSize, Checksum_t* checksum, ReadAhead_t * Ahead)
+{
+    HANDLE FileHandle;
+    int IsError = 0;
+
+    FileHandle = Ahead ? Ahead->Handle : OpenForData(fileName, FullReadFlags());
+    if (FileHandle == INVALID_HANDLE_VALUE) {
+        return 0;
+    }
+    memset(checksum, 0, sizeof(Checksum_t));
+
+    if (!ReadRangeCrc(FileHandle, 0, fileSize, checksum, Ahead)) {
+        IsError = 1;
+    }
+
+    CloseHandle(FileHandle);
+
+    return !IsError;
+}
+
+BOOL OpenTheFile(const TCHAR* FileName, HANDLE* FileHandle)
+{
+    *FileHandle = OpenForRead(FileName, 0);
+    if (*FileHandle == INVALID_HANDLE_VALUE) {
+        CantReadFile(FileName);
+        return FALSE;
+    }
+    return TRUE;
+}
+
+//--------------------------------------------------------------------------
+// Open a file and get its file index and link count.
+//--------------------------------------------------------------------------
+static BOOL ReadFileInfo(const TCHAR* FileName, HANDLE* FileHandle, BY_HANDLE_FILE_INFORMATION* FileInfo)
+{
+    LONGLONG Start;
+
+    if (!OpenTheFile(FileName, FileHandle)) return FALSE;
+    Start = TimerStart();
+    GetFileInformationByHandle(*FileHandle, FileInfo);
+    TimerStop(STAGE_METADATA, Start);
+
+    if (Ctx->Verbose){
+        ClearProgressInd();
+        Print(TEXT("Hardlinked (%d links) node=%08x %08x: %s\n"), FileInfo->nNumberOfLinks, 
+            FileInfo->nFileIndexHigh, FileInfo->nFileIndexLow, FileName);
+    }
+    return TRUE;
+}
+
+static void SetFileInfo(FileData_t* File, BY_HANDLE_FILE_INFORMATION* FileInfo)
+{
+    // Use the file index (which is NTFS equivalent of the iNode) instead of the CRC.
+    File->FileIndex.Low  = FileInfo->nFileIndexLow;
+    File->FileIndex.High = FileInfo->nFileIndexHigh;
+    File->FileIndex.Volume = FileInfo->dwVolumeSerialNumber;
+    File->NumLinks = FileInfo->nNumberOfLinks;
+}
+
+//--------------------------------------------------------------------------
+// Get the cluster on the volume where the data of a file starts, used to
+// read files in the order they are laid out on disk.  Files without clusters
+// of their own (small files kept in the MFT) return 0.
+//--------------------------------------------------------------------------
+static UINT64 GetFirstCluster(HANDLE FileHandle)
+{
+    STARTING_VCN_INPUT_BUFFER InBuf;
+    RETRIEVAL_POINTERS_BUFFER OutBuf;
+    DWORD Bytes;
+
+    // Only the first extent is asked for, the call fails with ERROR_MORE_DATA
+    // for fragmented files but fills in what fits.
+    InBuf.StartingVcn.QuadPart = 0;
+    if (!DeviceIoControl(FileHandle, FSCTL_GET_RETRIEVAL_POINTERS, &InBuf, sizeof(InBuf),
+            &OutBuf, sizeof(OutBuf), &Bytes, NULL) && GetLastError() != ERROR_MORE_DATA){
+        return 0;
+    }
+    if (OutBuf.ExtentCount == 0 || OutBuf.Extents[0].Lcn.QuadPart < 0) return 0;
+    return OutBuf.Extents[0].Lcn.QuadPart;
+}
+
+//--------------------------------------------------------------------------
+// Store a file in the bucket of its size, buckets keep arrival order.
+//--------------------------------------------------------------------------
+static void StoreFileData(FileData_t ThisFile, khint_t PathHash)
+{
+    FileData_t * Stored;
+    SizeBucket_t * Bucket;
+    int found;
+    LONGLONG Start = TimerStart();
+
+    ThisFile.Seq = Ctx->NumUnique;
+    ThisFile.Next = NULL;
+    Stored = NewFileData(ThisFile);
+
+    khiter_t k = kh_get_fd(ThisFile.FileSize, 1, &found);
+    Bucket = &kh_value(Ctx->FileDataMap, k);
+    if (Bucket->First == NULL) {
+        Bucket->First = Stored;
+    } else {
+        Bucket->Last->Next = Stored;
+    }
+    Bucket->Last = Stored;
+    Bucket->Count += 1;
+
+    AddKnownPath(Stored->FileName, PathHash);
+    TimerStop(STAGE_INSERT, Start);
+}
+
+//--------------------------------------------------------------------------
+// Candidate groups: files that may have the same content.  First all files of
+// one size, later split by 32k signature.  All members of all groups are kept
+// in one array, group after group, in arrival order within each group.
+//--------------------------------------------------------------------------
+#define CAND_OK         0
+#define CAND_CANT_OPEN -1          // Could not be opened
+#define CAND_READ_ERR  -2          // Read error while calculating the signature
+#define CAND_CHANGED   -3          // Size differs from the directory listing
+#define CAND_FULL_ERR  -4          // Read error during the full compare
+
+// Read jobs, run by a pool of threads.  Large files are split into parts of
+// PART_SIZE for the full compare, so one big file keeps all threads busy.
+#define LARGE_FILE_SIZE (64 * 1024 * 1024)
+#define PART_SIZE       (16 * 1024 * 1024)
+
+KHASH_INIT(fileidx, FileId_t, int, 1, FileIdHash, FileIdEqual)
+
+static void AddCandidate(FileData_t * File)
+{
+    Ctx->Candidates = GrowArray(Ctx->Candidates, &Ctx->CandidatesAlloc, Ctx->NumCandidates+1, sizeof(FileData_t*));
+    Ctx->CandidateLink = GrowArray(Ctx->CandidateLink, &Ctx->CandidateLinkAlloc, Ctx->NumCandidates+1, sizeof(int));
+    Ctx->CandidateState = GrowArray(Ctx->CandidateState, &Ctx->CandidateStateAlloc, Ctx->NumCandidates+1, sizeof(signed char));
+    Ctx->CandidateLink[Ctx->NumCandidates] = -1;
+    Ctx->CandidateState[Ctx->NumCandidates] = CAND_OK;
+    Ctx->Candidates[Ctx->NumCandidates++] = File;
+}
+
+//--------------------------------------------------------------------------
+// Queue reading a candidate.  For the full compare, large files are queued
+// as one job per part.
+//--------------------------------------------------------------------------
+static void AddReadJob(int Candidate, int Split)
+{
+    UINT64 FileSize = Ctx->Candidates[Candidate]->FileSize;
+    int Part, NumParts = 0;
+
+    if (Split && FileSize > LARGE_FILE_SIZE){
+        NumParts = (int)((FileSize + PART_SIZE - 1) / PART_SIZE);
+    }
+    Ctx->ReadJobs = GrowArray(Ctx->ReadJobs, &Ctx->ReadJobsAlloc, Ctx->NumReadJobs + (NumParts ? NumParts : 1), sizeof(ReadJob_t));
+    Part = NumParts ? 0 : -1;
+    do {
+        ReadJob_t * Job = &Ctx->ReadJobs[Ctx->NumReadJobs++];
+        memset(Job, 0, sizeof(ReadJob_t));
+        Job->Candidate = Candidate;
+        Job->Part = Part;
+    } while (++Part < NumParts);
+}
+
+//--------------------------------------------------------------------------
+// Close the group that started at index Start.  Groups of one, and groups
+// where nothing could be eliminated are dropped again.
+//--------------------------------------------------------------------------
+static void CloseGroup(int Start)
+{
+    int a, Eliminable = 0;
+
+    for (a = Start+1; a < Ctx->NumCandidates; a++){
+        if (!Ctx->Candidates[a]->IsReference) Eliminable = 1;
+    }
+    if (Ctx->NumCandidates - Start < 2 || !Eliminable){
+        Ctx->NumCandidates = Start;
+        return;
+    }
+
+    Ctx->GroupEnd = GrowArray(Ctx->GroupEnd, &Ctx->GroupsAlloc, Ctx->NumGroups+1, sizeof(int));
+    Ctx->GroupEnd[Ctx->NumGroups++] = Ctx->NumCandidates;
+}
+
+//--------------------------------------------------------------------------
+// Link members hardlinked to an earlier member of their group, they have the
+// same content and need no reads.  Returns the number of distinct files.
+//--------------------------------------------------------------------------
+static int LinkGroupMembers(int Start, int End, khash_t(fileidx) * Ids)
+{
+    int a, ret, Distinct = 0;
+
+    kh_clear(fileidx, Ids);
+    for (a = Start; a < End; a++){
+        FileId_t Id;
+        khiter_t k;
+        Id.Volume = Ctx->Candidates[a]->FileIndex.Volume;
+        Id.High = Ctx->Candidates[a]->FileIndex.High;
+        Id.Low = Ctx->Candidates[a]->FileIndex.Low;
+        k = kh_put(fileidx, Ids, Id, &ret);
+        if (ret == -1){
+            PrintError(TEXT("error storing file index"));
+            Fatal();
+        }
+        if (ret == 0){
+            Ctx->CandidateLink[a] = kh_value(Ids, k);
+        }else{
+            kh_value(Ids, k) = a;
+            Ctx->CandidateLink[a] = -1;
+            Distinct += 1;
+        }
+    }
+    return Distinct;
+}
+
+//--------------------------------------------------------------------------
+// Queue a read for each distinct file of each group that has more than one.
+// Groups of files that one of the tiers done so far read whole need no more
+// reads, for the full compare their last signature is their full checksum.
+//--------------------------------------------------------------------------
+static void QueueGroupReads(int TiersDone)
+{
+    khash_t(fileidx) * Ids = kh_init(fileidx);
+    int a, g, Start = 0;
+
+    Ctx->NumReadJobs = 0;
+    for (g = 0; g < Ctx->NumGroups; g++){
+        if (CoveredByTiers(TiersDone, Ctx->Candidates[Start]->FileSize)){
+            if (TiersDone == Ctx->NumTiers){
+                for (a = Start; a < Ctx->GroupEnd[g]; a++){
+                    Ctx->Candidates[a]->FullChecksum = Ctx->Candidates[a]->Checksum;
+                }
+            }
+        }else if (LinkGroupMembers(Start, Ctx->GroupEnd[g], Ids) > 1){
+            for (a = Start; a < Ctx->GroupEnd[g]; a++){
+                if (Ctx->CandidateLink[a] < 0) AddReadJob(a, TiersDone == Ctx->NumTiers);
+            }
+        }
+        Start = Ctx->GroupEnd[g];
+    }
+    kh_destroy(fileidx, Ids);
+}
+
+//--------------------------------------------------------------------------
+// Order read jobs disk by disk, and by where the data sits on the disk, so a
+// spinning disk sweeps across the platter instead of seeking back and forth.
+// Parts of one file stay together, in order.
+//--------------------------------------------------------------------------
+static int CompareJobPosition(const void * a, const void * b)
+{
+    const ReadJob_t * JobA = (const ReadJob_t *)a;
+    const ReadJob_t * JobB = (const ReadJob_t *)b;
+    FileData_t * A = Ctx->Candidates[JobA->Candidate];
+    FileData_t * B = Ctx->Candidates[JobB->Candidate];
+
+    if (A->Device != B->Device) return A->Device - B->Device;
+    if (A->FileIndex.Volume != B->FileIndex.Volume) return A->FileIndex.Volume < B->FileIndex.Volume ? -1 : 1;
+    if (A->FirstCluster != B->FirstCluster) return A->FirstCluster < B->FirstCluster ? -1 : 1;
+    if (A->Seq != B->Seq) return A->Seq - B->Seq;
+    return JobA->Part - JobB->Part;
+}
+
+//--------------------------------------------------------------------------
+// Find the physical disk of a volume, and whether it incurs a seek penalty.
+//--------------------------------------------------------------------------
+static void QueryDisk(const TCHAR * FileName, DWORD * DiskNumber, int * Rotational)
+{
+    TCHAR VolumePath[_MAX_PATH];
+    TCHAR DevicePath[_MAX_PATH];
+    STORAGE_DEVICE_NUMBER Number;
+    STORAGE_PROPERTY_QUERY Query;
+    DEVICE_SEEK_PENALTY_DESCRIPTOR Penalty;
+    DWORD Bytes;
+    HANDLE Volume;
+    size_t l;
+
+    *DiskNumber = (DWORD)-1;
+    *Rotational = 0;
+    if (!GetVolumePathName(FileName, VolumePath, _MAX_PATH)) return;
+    if (!GetVolumeNameForVolumeMountPoint(VolumePath, DevicePath, _MAX_PATH)) return; // Network drive
+
+    // Without the trailing backslash the volume itself is opened.  No access
+    // rights are needed for these queries.
+    l = _tcslen(DevicePath);
+    if (l && DevicePath[l-1] == '\\') DevicePath[l-1] = '\0';
+    Volume = CreateFile(DevicePath, 0, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL, OPEN_EXISTING, 0, NULL);
+    if (Volume == INVALID_HANDLE_VALUE) return;
+
+    if (DeviceIoControl(Volume, IOCTL_STORAGE_GET_DEVICE_NUMBER, NULL, 0,
+            &Number, sizeof(Number), &Bytes, NULL)){
+        *DiskNumber = Number.DeviceNumber;
+    }
+    memset(&Query, 0, sizeof(Query));
+    Query.PropertyId = StorageDeviceSeekPenaltyProperty;
+    Query.QueryType = PropertyStandardQuery;
+    if (DeviceIoControl(Volume, IOCTL_STORAGE_QUERY_PROPERTY, &Query, sizeof(Query),
+            &Penalty, sizeof(Penalty), &Bytes, NULL)){
+        *Rotational = Penalty.IncursSeekPenalty ? 1 : 0;
+    }
+    CloseHandle(Volume);
+}
+
+//--------------------------------------------------------------------------
+// Get the device index of a file, looked up once per volume.
+//--------------------------------------------------------------------------
+static int DeviceOf(FileData_t * File)
+{
+    DWORD DiskNumber;
+    int Rotational;
+    int v, d;
+
+    for (v = 0; v < Ctx->NumVolumes; v++){
+        if (Ctx->Volumes[v].Volume == File->FileIndex.Volume) return Ctx->Volumes[v].Device;
+    }
+
+    QueryDisk(File->FileName, &DiskNumber, &Rotational);
+    for (d = 0; d < Ctx->NumDevices; d++){
+        if (DiskNumber != (DWORD)-1 ? Ctx->Devices[d].DiskNumber == DiskNumber
+                : Ctx->Devices[d].Volume == File->FileIndex.Volume) break;
+    }
+    if (d == Ctx->NumDevices){
+        Ctx->Devices = GrowArray(Ctx->Devices, &Ctx->DevicesAlloc, Ctx->NumDevices+1, sizeof(Device_t));
+        memset(&Ctx->Devices[d], 0, sizeof(Device_t));
+        Ctx->Devices[d].DiskNumber = DiskNumber;
+        Ctx->Devices[d].Volume = File->FileIndex.Volume;
+        Ctx->Devices[d].Rotational = Rotational;
+        Ctx->Devices[d].Limit = Rotational ? Ctx->HddThreads : Ctx->NumThreads;
+        Ctx->NumDevices += 1;
+        if (Ctx->Verbose){
+            ClearProgressInd();
+            if (DiskNumber != (DWORD)-1){
+                Print(TEXT("Disk %u (%s): %d reads at once\n"), DiskNumber,
+                    Rotational ? TEXT("rotational") : TEXT("solid state"), Ctx->Devices[d].Limit);
+            }else{
+                Print(TEXT("Volume %08x (disk not known): %d reads at once\n"),
+                    File->FileIndex.Volume, Ctx->Devices[d].Limit);
+            }
+        }
+    }
+
+    Ctx->Volumes = GrowArray(Ctx->Volumes, &Ctx->VolumesAlloc, Ctx->NumVolumes+1, sizeof(VolumeDevice_t));
+    Ctx->Volumes[Ctx->NumVolumes].Volume = File->FileIndex.Volume;
+    Ctx->Volumes[Ctx->NumVolumes++].Device = d;
+    return d;
+}
+
+//--------------------------------------------------------------------------
+// Open the file of a full read job and start reading its head, for the read
+// thread that will run the job next (-cache prefetch).  If that fails, the
+// job opens the file itself and finds out what is wrong.
+//--------------------------------------------------------------------------
+static void StartReadAhead(ReadJob_t * Job, ReadAhead_t * Ahead)
+{
+    FileData_t * File = Ctx->Candidates[Job->Candidate];
+    UINT64 Offset = Job->Part > 0 ? (UINT64)Job->Part * PART_SIZE : 0;
+    UINT64 Length = File->FileSize - Offset;
+    DWORD Bytes;
+
+    Ahead->Handle = OpenForData(File->FileName, FullReadFlags() | FILE_FLAG_OVERLAPPED);
+    if (Ahead->Handle == INVALID_HANDLE_VALUE) return;
+
+    // Offset is a multiple of PART_SIZE, so aligned.
+    Bytes = ReadChunk(0, Length);
+    TakeTokens(&Ctx->ReadBytesLimit, (double)Bytes);
+    memset(&Ahead->Overlapped, 0, sizeof(OVERLAPPED));
+    Ahead->Overlapped.Offset = (DWORD)Offset;
+    Ahead->Overlapped.OffsetHigh = (DWORD)(Offset >> 32);
+    if (!ReadFile(Ahead->Handle, Ahead->Buffer, Bytes, NULL, &Ahead->Overlapped)
+            && GetLastError() != ERROR_IO_PENDING){
+        CloseHandle(Ahead->Handle);
+        return;
+    }
+    Job->Ahead = Ahead;
+}
+
+static void CancelReadAhead(ReadAhead_t * Ahead)
+{
+    DWORD Bytes;
+    CancelIo(Ahead->Handle);
+    WaitRead(Ahead->Handle, &Ahead->Overlapped, &Bytes);
+    CloseHandle(Ahead->Handle);
+}
+
+//--------------------------------------------------------------------------
+// Worker thread: take jobs of one disk in order.  When that disk has no jobs
+// left, move on to a disk that has jobs and fewer threads than it may have.
+// With -cache prefetch, a thread takes its next job before it runs the one
+// it has, and starts reading the head of the next one first.
+//--------------------------------------------------------------------------
+typedef struct {
+    Finddupe_t * Scan;
+    int Home;               // Disk to start with
+    int Slot;               // Timing slot, slot 0 is the main thread's
+}ReadWorkerParam_t;
+
+static unsigned __stdcall ReadWorker(void * Param)
+{
+    ReadWorkerParam_t * Worker = (ReadWorkerParam_t *)Param;
+    int Home = Worker->Home;
+    int d, Tried, ReadAhead;
+    ReadAhead_t Ahead[2];
+
+    Ctx = Worker->Scan;
+    TimingSlot = Worker->Slot;
+    ReadAhead = Ctx->ReadStage == STAGE_FULL && (Ctx->CacheHints & CACHE_PREFETCH);
+    if (ReadAhead){
+        Ahead[0].Buffer = GetReadBuffer();
+        Ahead[1].Buffer = GetReadBuffer();
+    }
+
+    if (Worker->Slot != 0){
+        // A thread of its own.  The thread that called in was set to
+        // background mode by RunScan if asked for.
+        if (Ctx->IdlePriority) SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+        SetMemoryPriority(MEMORY_PRIORITY_LOWEST);
+    }
+
+    for (Tried = 0, d = Home; Tried < Ctx->NumQueues; Tried++, d = (d + 1) % Ctx->NumQueues){
+        Device_t * Dev = &Ctx->Queues[d];
+        if (d != Home){
+            if (Dev->Next >= Dev->End) continue;
+            if (InterlockedIncrement(&Dev->Active) > Dev->Limit){
+                InterlockedDecrement(&Dev->Active);
+                continue;
+            }
+        }
+        if (ReadAhead){
+            LONG Job = InterlockedIncrement(&Dev->Next) - 1;
+            int Which = 0;
+            while (Job < Dev->End){
+                ReadJob_t * Taken = &Ctx->ReadJobs[Job];
+                LONG NextJob;
+                if (Ctx->Failed){
+                    if (Taken->Ahead) CancelReadAhead(Taken->Ahead);
+                    break;
+                }
+                NextJob = InterlockedIncrement(&Dev->Next) - 1;
+                if (NextJob < Dev->End) StartReadAhead(&Ctx->ReadJobs[NextJob], &Ahead[Which ^ 1]);
+                Ctx->ReadJobFunc(Taken);
+                InterlockedIncrement(&Ctx->ReadJobsDone);
+                ReleaseConsole();
+                Job = NextJob;
+                Which ^= 1;
+            }
+        }else{
+            for (;;){
+                LONG Job;
+                if (Ctx->Failed) break;
+                Job = InterlockedIncrement(&Dev->Next) - 1;
+                if (Job >= Dev->End) break;
+                Ctx->ReadJobFunc(&Ctx->ReadJobs[Job]);
+                InterlockedIncrement(&Ctx->ReadJobsDone);
+                ReleaseConsole();
+            }
+        }
+        InterlockedDecrement(&Dev->Active);
+        if (Ctx->Failed) break;
+    }
+    if (ReadAhead){
+        PutReadBuffer(Ahead[0].Buffer);
+        PutReadBuffer(Ahead[1].Buffer);
+    }
+    return 0;
+}
+
+static void RunReadJobs(ReadJobFunc_t Func, const TCHAR * What, int ByPosition)
+{
+    HANDLE Threads[MAXIMUM_WAIT_OBJECTS];
+    ReadWorkerParam_t Params[MAXIMUM_WAIT_OBJECTS];
+    int a, d, Started = 0;
+
+    ReleaseConsole();
+    Ctx->ReadJobsDone = 0;
+    Ctx->ReadJobFunc = Func;
+    Ctx->ProgressWhat = What;
+    if (Ctx->NumReadJobs == 0) return;
+
+    if (ByPosition){
+        // Split the jobs into one run per disk.
+        qsort(Ctx->ReadJobs, Ctx->NumReadJobs, sizeof(ReadJob_t), CompareJobPosition);
+        Ctx->Queues = Ctx->Devices;
+        Ctx->NumQueues = Ctx->NumDevices;
+        for (d = 0; d < Ctx->NumQueues; d++) Ctx->Queues[d].Next = Ctx->Queues[d].End = 0;
+        for (a = 0; a < Ctx->NumReadJobs; a++){
+            d = Ctx->Candidates[Ctx->ReadJobs[a].Candidate]->Device;
+            if (Ctx->Queues[d].End == 0) Ctx->Queues[d].Next = a;
+            Ctx->Queues[d].End = a + 1;
+        }
+    }else{
+        // Disks are not known yet.
+        Ctx->AllJobs.Limit = Ctx->NumThreads;
+        Ctx->AllJobs.Next = 0;
+        Ctx->AllJobs.End = Ctx->NumReadJobs;
+        Ctx->Queues = &Ctx->AllJobs;
+        Ctx->NumQueues = 1;
+    }
+
+    for (d = 0; d < Ctx->NumQueues; d++){
+        int Jobs = Ctx->Queues[d].End - Ctx->Queues[d].Next;
+        Ctx->Queues[d].Active = 0;
+        for (a = 0; a < Ctx->Queues[d].Limit && a < Jobs && Started < MAXIMUM_WAIT_OBJECTS; a++){
+            Ctx->Queues[d].Active += 1;
+            Params[Started].Scan = Ctx;
+            Params[Started].Home = d;
+            Params[Started].Slot = Started + 1;
+            Threads[Started] = (HANDLE)_beginthreadex(NULL, 0, ReadWorker, &Params[Started], 0, NULL);
+            if (Threads[Started] == 0){
+                Ctx->Queues[d].Active -= 1;
+                break;
+            }
+            Started += 1;
+        }
+    }
+    if (Started == 0){
+        // No threads to be had, do it on this one, and leave it as it was.
+        SetMemoryPriority(MEMORY_PRIORITY_LOWEST);
+        for (d = 0; d < Ctx->NumQueues; d++){
+            Ctx->Queues[d].Active = 1;
+            Params[0].Scan = Ctx;
+            Params[0].Home = d;
+            Params[0].Slot = 0;
+            ReadWorker(&Params[0]);
+        }
+        SetMemoryPriority(MEMORY_PRIORITY_DEFAULT);
+        return;
+    }
+
+    WaitForMultipleObjects(Started, Threads, TRUE, INFINITE);
+    for (a = 0; a < Started; a++) CloseHandle(Threads[a]);
+    if (Ctx->Failed) Fatal();
+}
+
+//--------------------------------------------------------------------------
+// Read jobs.  These run on the worker threads, so they only record the
+// outcome, messages are printed afterwards by ReportCandidates.
+//--------------------------------------------------------------------------
+static void LoadInfoJob(ReadJob_t * Job)
+{
+    int Candidate = Job->Candidate;
+    FileData_t * File = Ctx->Candidates[Candidate];
+    BY_HANDLE_FILE_INFORMATION FileInfo;
+    ULARGE_INTEGER ul;
+    HANDLE FileHandle;
+    LONGLONG Start;
+
+    FileHandle = OpenForRead(File->FileName, 0);
+    if (FileHandle == INVALID_HANDLE_VALUE){
+        Ctx->CandidateState[Candidate] = CAND_CANT_OPEN;
+        return;
+    }
+    Start = TimerStart();
+    GetFileInformationByHandle(FileHandle, &FileInfo);
+    SetFileInfo(File, &FileInfo);
+
+    ul.HighPart = FileInfo.nFileSizeHigh;
+    ul.LowPart = FileInfo.nFileSizeLow;
+    if (ul.QuadPart != File->FileSize){
+        // Modified since the directory was listed.
+        Ctx->CandidateState[Candidate] = CAND_CHANGED;
+    }
+    File->FirstCluster = GetFirstCluster(FileHandle);
+    TimerStop(STAGE_METADATA, Start);
+    CloseHandle(FileHandle);
+}
+
+static void SignatureJob(ReadJob_t * Job)
+{
+    int Candidate = Job->Candidate;
+    FileData_t * File = Ctx->Candidates[Candidate];
+    HANDLE FileHandle;
+
+    if (Ctx->CandidateState[Candidate] != CAND_OK) return;
+
+    FileHandle = OpenForData(File->FileName, 0);
+    if (FileHandle == INVALID_HANDLE_VALUE){
+        Ctx->CandidateState[Candidate] = CAND_CANT_OPEN;
+        return;
+    }
+    if (!ReadTierChecksum(FileHandle, Ctx->CurrentTier, File->FileSize, &File->Checksum)){
+        Ctx->CandidateState[Candidate] = CAND_READ_ERR;
+    }
+    CloseHandle(FileHandle);
+}
+
+static void FullReadJob(ReadJob_t * Job)
+{
+    FileData_t * File = Ctx->Candidates[Job->Candidate];
+    Checksum_t chk;
+    UINT64 Offset, Length;
+    HANDLE FileHandle;
+
+    if (Job->Part < 0){
+        if (ReadFileAndCalculateCRC(File->FileName, File->FileSize, &chk, Job->Ahead)){
+            File->FullChecksum = chk;
+        }else{
+            Ctx->CandidateState[Job->Candidate] = CAND_FULL_ERR;
+        }
+        DropFromCache(File->FileName);
+        return;
+    }
+
+    // One part of a large file, combined by CombineParts.
+    Offset = (UINT64)Job->Part * PART_SIZE;
+    Length = File->FileSize - Offset;
+    if (Length > PART_SIZE) Length = PART_SIZE;
+
+    FileHandle = Job->Ahead ? Job->Ahead->Handle : OpenForData(File->FileName, FullReadFlags());
+    if (FileHandle == INVALID_HANDLE_VALUE){
+        Job->Failed = 1;
+        return;
+    }
+    if (!ReadRangeCrc(FileHandle, Offset, Length, &Job->Sum, Job->Ahead)) Job->Failed = 1;
+    CloseHandle(FileHandle);
+    // Parts are queued in order, so the others were taken before the last
+    // one.  One still being read only loses the pages not read yet.
+    if (Offset + Length == File->FileSize) DropFromCache(File->FileName);
+}
+
+//--------------------------------------------------------------------------
+// The full checksum of a file read in parts is the checksum over the
+// checksums of its parts, in order.  A hash tree of two levels, all files of
+// one size are split the same way so their checksums compare.
+//--------------------------------------------------------------------------
+static void CombineParts(void)
+{
+    int j;
+
+    for (j = 0; j < Ctx->NumReadJobs; j++){
+        ReadJob_t * Job = &Ctx->ReadJobs[j];
+        FileData_t * File = Ctx->Candidates[Job->Candidate];
+
+        if (Job->Part < 0) continue;
+        if (Job->Part == 0) memset(&File->FullChecksum, 0, sizeof(Checksum_t));
+        if (Job->Failed) Ctx->CandidateState[Job->Candidate] = CAND_FULL_ERR;
+        CalcCrc(&File->FullChecksum, (char *)&Job->Sum, sizeof(Checksum_t));
+    }
+}
+
+//--------------------------------------------------------------------------
+// Print what happened to the candidates during a read stage, in group order.
+//--------------------------------------------------------------------------
+static void ReportCandidates(int Stage)
+{
+    LONGLONG Start = TimerStart();
+    int a;
+
+    for (a = 0; a < Ctx->NumCandidates; a++){
+        FileData_t * File = Ctx->Candidates[a];
+        switch (Ctx->CandidateState[a]){
+            case CAND_CANT_OPEN:
+                CantReadFile(File->FileName);
+                break;
+            case CAND_READ_ERR:
+                Ctx->DupeStats.ReadErrors += 1;
+                if (!Ctx->HideCantReadMessage){
+                    ClearProgressInd();
+                    PrintError(TEXT("file read problem on '%s'\n"), File->FileName);
+                }
+                break;
+            case CAND_FULL_ERR:
+                // Counted with the group, see ResolveGroup.
+                ClearProgressInd();
+                PrintError(TEXT("Error doing full file read on '%s'\n"), File->FileName);
+                break;
+            case CAND_CHANGED:
+                if (Ctx->Verbose){
+                    ClearProgressInd();
+                    Print(TEXT("Size changed, skipping '%s'\n"), File->FileName);
+                }
+                break;
+            case CAND_OK:
+                if (Stage == 0 && Ctx->Verbose){
+                    ClearProgressInd();
+                    Print(TEXT("Hardlinked (%d links) node=%08x %08x: %s\n"), File->NumLinks,
+                        File->FileIndex.High, File->FileIndex.Low, File->FileName);
+                }
+                if (Stage == 1 && Ctx->PrintFileSigs){
+                    ClearProgressInd();
+                    Print(TEXT("%08x%08x %10llu %s\n"), File->Checksum.Crc, File->Checksum.Sum,
+                        File->FileSize, File->FileName);
+                }
+                break;
+        }
+    }
+    ReleaseConsole();
+    TimerStop(STAGE_OUTPUT, Start);
+}
+
+//--------------------------------------------------------------------------
+// Sort group members by signature, keeping arrival order within equal ones.
+//--------------------------------------------------------------------------
+static int CompareSignature(const void * a, const void * b)
+{
+    FileData_t * A = *(FileData_t * const *)a;
+    FileData_t * B = *(FileData_t * const *)b;
+    int comp = memcmp(&A->Checksum, &B->Checksum, sizeof(Checksum_t));
+    if (comp) return comp;
+    return A->Seq - B->Seq;
+}
+
+//--------------------------------------------------------------------------
+// Hardlinked members share the result of the file they are linked to.
+//--------------------------------------------------------------------------
+static void FollowLinks(void)
+{
+    int a;
+    for (a = 0; a < Ctx->NumCandidates; a++){
+        if (Ctx->CandidateLink[a] >= 0){
+            Ctx->CandidateState[a] = Ctx->CandidateState[Ctx->CandidateLink[a]];
+            Ctx->Candidates[a]->Checksum = Ctx->Candidates[Ctx->CandidateLink[a]]->Checksum;
+        }
+    }
+}
+
+//--------------------------------------------------------------------------
+// Split every group into runs of equal signature, dropping members that
+// failed.  Done in place, the new groups never start behind the old ones.
+//--------------------------------------------------------------------------
+static void SplitGroups(void)
+{
+    int OldGroups = Ctx->NumGroups;
+    int a, g, Start = 0;
+
+    Ctx->OldEnd = GrowArray(Ctx->OldEnd, &Ctx->OldEndAlloc, OldGroups, sizeof(int));
+    memcpy(Ctx->OldEnd, Ctx->GroupEnd, OldGroups * sizeof(int));
+    Ctx->NumGroups = 0;
+    Ctx->NumCandidates = 0;
+
+    for (g = 0; g < OldGroups; g++){
+        int End = Ctx->OldEnd[g];
+        int Kept = Start;
+        int RunStart;
+
+        for (a = Start; a < End; a++){
+            if (Ctx->CandidateState[a] == CAND_OK) Ctx->Candidates[Kept++] = Ctx->Candidates[a];
+        }
+        qsort(Ctx->Candidates + Start, Kept - Start, sizeof(FileData_t*), CompareSignature);
+
+        RunStart = Ctx->NumCandidates;
+        for (a = Start; a < Kept; a++){
+            if (Ctx->NumCandidates > RunStart
+                    && memcmp(&Ctx->Candidates[RunStart]->Checksum, &Ctx->Candidates[a]->Checksum, sizeof(Checksum_t)) != 0){
+                CloseGroup(RunStart);
+                RunStart = Ctx->NumCandidates;
+            }
+            Ctx->Candidates[Ctx->NumCandidates] = Ctx->Candidates[a];
+            Ctx->CandidateLink[Ctx->NumCandidates] = -1;
+            Ctx->CandidateState[Ctx->NumCandidates] = CAND_OK;
+            Ctx->NumCandidates += 1;
+        }
+        if (Ctx->NumCandidates > RunStart) CloseGroup(RunStart);
+        Start = End;
+    }
+}
+
+//--------------------------------------------------------------------------
+// Pass a group of files to the group callback, the first one is the file
+// that was kept.
+//--------------------------------------------------------------------------
+static void ReportGroup(FileData_t ** Members, int NumMembers)
+{
+    int a;
+
+    Ctx->GroupFiles = GrowArray(Ctx->GroupFiles, &Ctx->GroupFilesAlloc, NumMembers, sizeof(FinddupeFile_t));
+    for (a = 0; a < NumMembers; a++){
+        FinddupeFile_t * File = &Ctx->GroupFiles[a];
+        File->FileName = Members[a]->FileName;
+        File->FileSize = Members[a]->FileSize;
+        File->IsReference = Members[a]->IsReference;
+        File->Hardlinked = a > 0 && memcmp(&Members[a]->FileIndex, &Members[0]->FileIndex,
+            sizeof(Members[0]->FileIndex)) == 0;
+    }
+    Ctx->OnGroup(Ctx->User, Ctx->GroupFiles, NumMembers);
+}
+
+//--------------------------------------------------------------------------
+// Report the classes of a resolved group that have more than one file.  The
+// members are sorted by class, keeping arrival order, so the class sizes are
+// turned into the end of each class in GroupMembers.
+//--------------------------------------------------------------------------
+static void ReportClasses(int Start, int End, int NumClasses)
+{
+    int a, c, Pos = 0;
+
+    Ctx->GroupMembers = GrowArray(Ctx->GroupMembers, &Ctx->GroupMembersAlloc, End-Start, sizeof(FileData_t*));
+    for (c = 0; c < NumClasses; c++){
+        int Size = Ctx->ClassSize[c];
+        Ctx->ClassSize[c] = Pos;
+        Pos += Size;
+    }
+    for (a = Start; a < End; a++){
+        c = Ctx->ClassOf[a-Start];
+        if (c >= 0) Ctx->GroupMembers[Ctx->ClassSize[c]++] = Ctx->Candidates[a];
+    }
+    for (c = 0, Pos = 0; c < NumClasses; Pos = Ctx->ClassSize[c++]){
+        if (Ctx->ClassSize[c] - Pos > 1) ReportGroup(Ctx->GroupMembers + Pos, Ctx->ClassSize[c] - Pos);
+    }
+}
+
+//--------------------------------------------------------------------------
+// Partition one group into classes of equal content in one pass, and act on
+// the duplicates.  The first file of a class (in arrival order) is kept.
+//--------------------------------------------------------------------------
+static void ResolveGroup(int Start, int End)
+{
+    int NumClasses = 0;
+    int a, c;
+
+    Ctx->ClassOf = GrowArray(Ctx->ClassOf, &Ctx->ClassOfAlloc, End-Start, sizeof(int));
+
+    for (a = Start; a < End; a++){
+        FileData_t * File = Ctx->Candidates[a];
+        FileData_t * Keeper;
+        int Hardlinked;
+
+        if (Ctx->CandidateLink[a] >= 0){
+            // Same physical file as an earlier member, so same class.
+            c = Ctx->ClassOf[Ctx->CandidateLink[a]-Start];
+            if (c < 0) Ctx->DupeStats.ReadErrors += 1;
+        }else if (Ctx->CandidateState[a] < 0){
+            // Could not be read, can't tell.
+            Ctx->DupeStats.ReadErrors += 1;
+            c = -1;
+        }else{
+            for (c = 0; c < NumClasses; c++){
+                if (memcmp(&Ctx->Keepers[c]->FullChecksum, &File->FullChecksum, sizeof(Checksum_t)) == 0) break;
+            }
+            if (c == NumClasses){
+                Ctx->Keepers = GrowArray(Ctx->Keepers, &Ctx->KeepersAlloc, NumClasses+1, sizeof(FileData_t*));
+                Ctx->ClassSize = GrowArray(Ctx->ClassSize, &Ctx->ClassSizeAlloc, NumClasses+1, sizeof(int));
+                Ctx->Keepers[NumClasses] = File;
+                Ctx->ClassSize[NumClasses++] = 1;
+                Ctx->ClassOf[a-Start] = c;
+                continue;
+            }
+        }
+        Ctx->ClassOf[a-Start] = c;
+        if (c < 0) continue;
+        Ctx->ClassSize[c] += 1;
+
+        Keeper = Ctx->Keepers[c];
+        if (File->IsReference) continue; // Reference files are only checked against.
+
+        Hardlinked = memcmp(&File->FileIndex, &Keeper->FileIndex, sizeof(Keeper->FileIndex)) == 0;
+        if (!Hardlinked && Keeper->NumLinks >= 1023){
+            // Do not link more than 1023 files onto one physical file (windows limit),
+            // further duplicates are checked against this one.
+            Ctx->Keepers[c] = File;
+            continue;
+        }
+
+        if (EliminateDuplicate(File, Keeper, Hardlinked) == 2){
+            Keeper->NumLinks += 1; // Update link count.
+        }
+    }
+
+    for (a = Start; a < End; a++){
+        c = Ctx->ClassOf[a-Start];
+        if (c < 0 || Ctx->ClassSize[c] == 1) Ctx->Tiers[Ctx->NumTiers].RuledOut += 1;
+    }
+
+    if (IsAdaptivePrefix(&Ctx->Tiers[0]) && !CoveredByTiers(Ctx->NumTiers, Ctx->Candidates[Start]->FileSize)){
+        // Feedback for the head length of this size class.
+        c = SizeClass(Ctx->Candidates[Start]->FileSize);
+        Ctx->PrefixGroups[c] += 1;
+        if (NumClasses > 1) Ctx->PrefixMisses[c] += 1;
+    }
+
+    if (Ctx->OnGroup) ReportClasses(Start, End, NumClasses);
+}
+
+//--------------------------------------------------------------------------
+// Adapt the head length of each size class to what the last batches showed.
+// Longer heads cost little next to full reads of large files, so grow them
+// when more than one in eight groups with equal heads differed.  Shrink them
+// when no group differed, to keep from reading more than needed.
+//--------------------------------------------------------------------------
+static void AdaptPrefixes(void)
+{
+    int c;
+    for (c = 0; c < 64; c++){
+        if (Ctx->PrefixGroups[c] < 16) continue;
+        if (Ctx->PrefixMisses[c] * 8 > Ctx->PrefixGroups[c]){
+            if (Ctx->PrefixBytes[c] < MAX_PREFIX && Ctx->PrefixBytes[c] < ((UINT64)2 << c)){
+                Ctx->PrefixBytes[c] *= 2;
+                Ctx->PrefixChanged = 1;
+            }
+        }else if (Ctx->PrefixMisses[c] == 0 && Ctx->PrefixGroups[c] >= 64){
+            if (Ctx->PrefixBytes[c] > MIN_PREFIX){
+                Ctx->PrefixBytes[c] /= 2;
+                Ctx->PrefixChanged = 1;
+            }
+        }else{
+            continue;
+        }
+        Ctx->PrefixGroups[c] = Ctx->PrefixMisses[c] = 0;
+    }
+}
+
+//--------------------------------------------------------------------------
+// Count what goes into a tier, and what was read.
+//--------------------------------------------------------------------------
+static void CountTierInput(Tier_t * Tier)
+{
+    Tier->Groups += Ctx->NumGroups;
+    Tier->Files += Ctx->NumCandidates;
+}
+
+static void CountTierReads(Tier_t * Tier)
+{
+    int j;
+    for (j = 0; j < Ctx->NumReadJobs; j++){
+        if (Ctx->ReadJobs[j].Part > 0) continue; // Count a file only once
+        Tier->FilesRead += 1;
+        if (Ctx->CandidateState[Ctx->ReadJobs[j].Candidate] == CAND_OK){
+            UINT64 FileSize = Ctx->Candidates[Ctx->ReadJobs[j].Candidate]->FileSize;
+            Tier->BytesRead += (Tier->Kind == TIER_FULL) ? FileSize : TierBytes(Tier, FileSize);
+        }
+    }
+}
+
+//--------------------------------------------------------------------------
+// Resolve the groups collected so far: the members are opened to get file
+// index and data position, then the signatures of each tier and the full
+// checksums are read in order of position on disk, and each group is
+// resolved.
+//--------------------------------------------------------------------------
+static void ResolveBatch(void)
+{
+    int a, g, t, Start;
+
+    Ctx->NumReadJobs = 0;
+    for (a = 0; a < Ctx->NumCandidates; a++) AddReadJob(a, 0);
+    RunReadJobs(LoadInfoJob, TEXT("Opening"), 0);
+    ReportCandidates(0);
+    for (a = 0; a < Ctx->NumCandidates; a++){
+        if (Ctx->CandidateState[a] == CAND_OK) Ctx->Candidates[a]->Device = DeviceOf(Ctx->Candidates[a]);
+    }
+    SplitGroups();
+
+    Ctx->ReadStage = STAGE_PREFIX;
+    for (t = 0; t < Ctx->NumTiers; t++){
+        int FilesBefore = Ctx->NumCandidates;
+        Ctx->CurrentTier = &Ctx->Tiers[t];
+        CountTierInput(&Ctx->Tiers[t]);
+        QueueGroupReads(t);
+        RunReadJobs(SignatureJob, TEXT("Reading signatures of"), 1);
+        FollowLinks();
+        CountTierReads(&Ctx->Tiers[t]);
+        ReportCandidates(t == 0 ? 1 : 2);
+        SplitGroups();
+        Ctx->Tiers[t].RuledOut += FilesBefore - Ctx->NumCandidates;
+    }
+
+    CountTierInput(&Ctx->Tiers[Ctx->NumTiers]);
+    QueueGroupReads(Ctx->NumTiers);
+    Ctx->ReadStage = STAGE_FULL;
+    RunReadJobs(FullReadJob, TEXT("Comparing"), 1);
+    CombineParts();
+    CountTierReads(&Ctx->Tiers[Ctx->NumTiers]);
+    ReportCandidates(3);
+
+    Start = 0;
+    for (g = 0; g < Ctx->NumGroups; g++){
+        ResolveGroup(Start, Ctx->GroupEnd[g]);
+        Start = Ctx->GroupEnd[g];
+    }
+    Ctx->NumCandidates = 0;
+    Ctx->NumGroups = 0;
+    ReleaseConsole();
+}
+
+static int CompareBucketSize(const void * a, const void * b)
+{
+    UINT64 A = kh_key(Ctx->FileDataMap, *(const khint_t *)a);
+    UINT64 B = kh_key(Ctx->FileDataMap, *(const khint_t *)b);
+    return (A > B) - (A < B);
+}
+
+//--------------------------------------------------------------------------
+// After the scan: every size shared by two or more files makes a group.
+// Groups are resolved in batches, smallest sizes first, so the head length
+// of each size class can adapt to what earlier batches of that class showed.
+//--------------------------------------------------------------------------
+static void ResolveGroups(void)
+{
+    khint_t * Sizes = NULL;
+    int SizesAlloc = 0;
+    int NumSizes = 0;
+    int s, Start;
+    UINT64 BatchBytes = 0;
+    khint_t k;
+
+    for (k = kh_begin(Ctx->FileDataMap); k != kh_end(Ctx->FileDataMap); ++k){
+        if (!kh_exist(Ctx->FileDataMap, k) || kh_value(Ctx->FileDataMap, k).Count < 2) continue;
+        Sizes = GrowArray(Sizes, &SizesAlloc, NumSizes+1, sizeof(khint_t));
+        Sizes[NumSizes++] = k;
+        Ctx->CandidateBytes += kh_key(Ctx->FileDataMap, k) * kh_value(Ctx->FileDataMap, k).Count;
+        Ctx->CandidateFiles += kh_value(Ctx->FileDataMap, k).Count;
+    }
+    if (NumSizes) qsort(Sizes, NumSizes, sizeof(khint_t), CompareBucketSize);
+    Ctx->ResolveStart = GetTickCount();
+
+    for (s = 0; s < NumSizes; s++){
+        FileData_t * File;
+        Start = Ctx->NumCandidates;
+        for (File = kh_value(Ctx->FileDataMap, Sizes[s]).First; File != NULL; File = File->Next){
+            AddCandidate(File);
+        }
+        CloseGroup(Start);
+        BatchBytes += kh_key(Ctx->FileDataMap, Sizes[s]) * kh_value(Ctx->FileDataMap, Sizes[s]).Count;
+
+        if (Ctx->NumCandidates >= BATCH_FILES || s == NumSizes-1){
+            int BatchFiles = Ctx->NumCandidates;
+            ResolveBatch();
+            AdaptPrefixes();
+            Ctx->ResolvedBytes += BatchBytes;
+            Ctx->ResolvedFiles += BatchFiles;
+            BatchBytes = 0;
+        }
+    }
+    free(Sizes);
+}
+
+//--------------------------------------------------------------------------
+// Metrics for the textfile collector of the Prometheus node exporter
+// (-metrics).  A thread of its own rewrites the file every METRICS_INTERVAL,
+// so a long scan shows up while it runs.  The file is written under another
+// name and renamed, so the collector never reads half a file.
+//--------------------------------------------------------------------------
+#define METRICS_INTERVAL 15000  // ms
+
+//--------------------------------------------------------------------------
+// Read a counter another thread writes.  It is read until two reads agree,
+// so a 32-bit build does not see half an update.
+//--------------------------------------------------------------------------
+static UINT64 ReadCounter(const volatile UINT64 * Count)
+{
+    UINT64 a, b;
+    do {
+        a = *Count;
+        b = *Count;
+    } while (a != b);
+    return a;
+}
+
+//--------------------------------------------------------------------------
+// Sum of one per-slot counter, each slot is written by one thread only.
+//--------------------------------------------------------------------------
+static UINT64 SumIoCount(size_t Offset)
+{
+    UINT64 Sum = 0;
+    int Slot;
+
+    for (Slot = 0; Slot < TIMING_SLOTS; Slot++){
+        Sum += ReadCounter((volatile UINT64 *)((char *)&Ctx->IoCounts[Slot] + Offset));
+    }
+    return Sum;
+}
+
+static void WriteMetrics(int Running)
+{
+    TCHAR TempName[_MAX_PATH + 8];
+    PROCESS_MEMORY_COUNTERS Memory;
+    LONG Pending = Ctx->NumReadJobs - Ctx->ReadJobsDone;
+    FILE * File;
+
+    _sntprintf(TempName, _MAX_PATH + 8, TEXT("%s.tmp"), Ctx->MetricsFileName);
+    File = _tfopen(TempName, TEXT("w"));
+    if (File == NULL) return; // Try again next time.
+
+    memset(&Memory, 0, sizeof(Memory));
+    GetProcessMemoryInfo(GetCurrentProcess(), &Memory, sizeof(Memory));
+    if (Pending < 0) Pending = 0;
+
+    _ftprintf(File, TEXT("# HELP finddupe_files_scanned_total Files found by the scan.\n"));
+    _ftprintf(File, TEXT("# TYPE finddupe_files_scanned_total counter\n"));
+    _ftprintf(File, TEXT("finddupe_files_scanned_total %d\n"), Ctx->FilesScanned);
+    _ftprintf(File, TEXT("# HELP finddupe_read_bytes_total Bytes read from files.\n"));
+    _ftprintf(File, TEXT("# TYPE finddupe_read_bytes_total counter\n"));
+    _ftprintf(File, TEXT("finddupe_read_bytes_total %llu\n"), SumIoCount(offsetof(IoCounts_t, BytesRead)));
+    _ftprintf(File, TEXT("# HELP finddupe_hashed_bytes_total Bytes added to signatures and checksums.\n"));
+    _ftprintf(File, TEXT("# TYPE finddupe_hashed_bytes_total counter\n"));
+    _ftprintf(File, TEXT("finddupe_hashed_bytes_total %llu\n"), SumIoCount(offsetof(IoCounts_t, BytesHashed)));
+    _ftprintf(File, TEXT("# HELP finddupe_duplicate_files_total Duplicate files found.\n"));
+    _ftprintf(File, TEXT("# TYPE finddupe_duplicate_files_total counter\n"));
+    _ftprintf(File, TEXT("finddupe_duplicate_files_total %d\n"), Ctx->DupeStats.DuplicateFiles);
+    _ftprintf(File, TEXT("# HELP finddupe_duplicate_bytes_total Bytes in duplicate files, freed with -del or -hardlink.\n"));
+    _ftprintf(File, TEXT("# TYPE finddupe_duplicate_bytes_total counter\n"));
+    _ftprintf(File, TEXT("finddupe_duplicate_bytes_total %llu\n"), Ctx->DupeStats.DuplicateBytes);
+    _ftprintf(File, TEXT("# HELP finddupe_errors_total Files that could not be opened or read.\n"));
+    _ftprintf(File, TEXT("# TYPE finddupe_errors_total counter\n"));
+    _ftprintf(File, TEXT("finddupe_errors_total %d\n"), Ctx->DupeStats.CantReadFiles + Ctx->DupeStats.ReadErrors);
+    _ftprintf(File, TEXT("# HELP finddupe_read_jobs_pending Reads queued in the current read stage.\n"));
+    _ftprintf(File, TEXT("# TYPE finddupe_read_jobs_pending gauge\n"));
+    _ftprintf(File, TEXT("finddupe_read_jobs_pending %d\n"), Pending);
+    _ftprintf(File, TEXT("# HELP finddupe_candidate_files Files in the batch of candidate groups being resolved.\n"));
+    _ftprintf(File, TEXT("# TYPE finddupe_candidate_files gauge\n"));
+    _ftprintf(File, TEXT("finddupe_candidate_files %d\n"), Ctx->NumCandidates);
+    _ftprintf(File, TEXT("# HELP finddupe_resident_bytes Working set of the process.\n"));
+    _ftprintf(File, TEXT("# TYPE finddupe_resident_bytes gauge\n"));
+    _ftprintf(File, TEXT("finddupe_resident_bytes %llu\n"), (UINT64)Memory.WorkingSetSize);
+    _ftprintf(File, TEXT("# HELP finddupe_running Whether the scan is still running.\n"));
+    _ftprintf(File, TEXT("# TYPE finddupe_running gauge\n"));
+    _ftprintf(File, TEXT("finddupe_running %d\n"), Running);
+    _ftprintf(File, TEXT("# HELP finddupe_last_update_seconds Time this file was written.\n"));
+    _ftprintf(File, TEXT("# TYPE finddupe_last_update_seconds gauge\n"));
+    _ftprintf(File, TEXT("finddupe_last_update_seconds %lld\n"), (long long)_time64(NULL));
+    fclose(File);
+
+    MoveFileEx(TempName, Ctx->MetricsFileName, MOVEFILE_REPLACE_EXISTING);
+}
+
+static unsigned __stdcall MetricsWorker(void * Param)
+{
+    Ctx = (Finddupe_t *)Param;
+    while (WaitForSingleObject(Ctx->MetricsStop, METRICS_INTERVAL) == WAIT_TIMEOUT){
+        WriteMetrics(1);
+    }
+    return 0;
+}
+
+static void StartMetrics(void)
+{
+    WriteMetrics(1);
+    Ctx->MetricsStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    Ctx->MetricsThread = (HANDLE)_beginthreadex(NULL, 0, MetricsWorker, Ctx, 0, NULL);
+}
+
+static void StopMetrics(void)
+{
+    if (Ctx->MetricsThread){
+        SetEvent(Ctx->MetricsStop);
+        WaitForSingleObject(Ctx->MetricsThread, INFINITE);
+        CloseHandle(Ctx->MetricsThread);
+        Ctx->MetricsThread = NULL;
+    }
+    CloseHandle(Ctx->MetricsStop);
+    Ctx->MetricsStop = NULL;
+    WriteMetrics(0);
+}
+
+//--------------------------------------------------------------------------
+// Progress.  A thread of its own samples the counters five times a second
+// and shows files per second while scanning, and MB per second, the
+// candidate files left and the time left while comparing.  The time left
+// comes from the bytes of candidate groups resolved so far, against all
+// bytes in groups of equal size.  This thread also picks up changes to the
+// control file and Ctrl+Break requests.
+//--------------------------------------------------------------------------
+#define PROGRESS_INTERVAL 200   // ms
+
+//--------------------------------------------------------------------------
+// Take a sample of the counters, for the progress line or the callback.
+//--------------------------------------------------------------------------
+static void SampleProgress(FinddupeProgress_t * Progress)
+{
+    Progress->Stage = Ctx->ProgressWhat;
+    Progress->FilesScanned = Ctx->FilesScanned;
+    Progress->BytesScanned = ReadCounter(&Ctx->DupeStats.TotalBytes);
+    Progress->ReadsDone = Ctx->ReadJobsDone;
+    Progress->ReadsQueued = Ctx->NumReadJobs;
+    Progress->BytesRead = SumIoCount(offsetof(IoCounts_t, BytesRead));
+    Progress->CandidatesLeft = Ctx->CandidateFiles - Ctx->ResolvedFiles;
+    Progress->SecondsLeft = -1;
+    if (Progress->Stage != NULL){
+        UINT64 Done = ReadCounter(&Ctx->ResolvedBytes);
+        if (Done){
+            // Time so far, scaled by the bytes still to go.
+            Progress->SecondsLeft = (GetTickCount() - Ctx->ResolveStart) / 1000.0 * (Ctx->CandidateBytes - Done) / Done;
+        }
     }
+}
+
+static void ShowProgressLine(const FinddupeProgress_t * Progress)
+{
+    TCHAR Line[120];
+
+    if (Progress->Stage == NULL){
+        _sntprintf(Line, 120, TEXT("Scanned %d files, %llu MB, %.0f files/s"),
+            Progress->FilesScanned, Progress->BytesScanned >> 20, Progress->FilesPerSecond);
+    }else{
+        TCHAR Left[20] = TEXT("?");
+        if (Progress->SecondsLeft >= 0){
+            double Seconds = Progress->SecondsLeft;
+            _sntprintf(Left, 20, TEXT("%d:%02d:%02d"), (int)(Seconds / 3600),
+                (int)(Seconds / 60) % 60, (int)Seconds % 60);
+        }
+        _sntprintf(Line, 120, TEXT("%s %d of %d files, %.1f MB/s, %d candidates left, ETA %s"),
+            Progress->Stage, Progress->ReadsDone, Progress->ReadsQueued,
+            Progress->BytesPerSecond / (1024 * 1024), Progress->CandidatesLeft, Left);
+    }
+    Line[119] = '\0';
+    _tprintf(TEXT("%-77s\r"), Line);
+    Ctx->ProgressIndicatorVisible = 1;
+}
 
-    if (MeasureDurations) { ticksByteRead = GetTickCount() - ticksByteRead; totalByteRead += ticksByteRead; ticksCRC = GetTickCount(); }
+static unsigned __stdcall ProgressWorker(void * Param)
+{
+    FinddupeProgress_t Progress;
+    DWORD Last = GetTickCount(), Now;
+    int LastFiles = 0;
+    UINT64 LastRead = 0;
+    double FileRate = 0, ByteRate = 0;
 
-    CalcCrc(&CheckSum, FileBuffer, BytesRead);
+    Ctx = (Finddupe_t *)Param;
+    while (WaitForSingleObject(Ctx->ProgressStop, PROGRESS_INTERVAL) == WAIT_TIMEOUT){
+        double Seconds;
 
-    if (MeasureDurations) { ticksCRC = GetTickCount() - ticksCRC; totalCRC += ticksCRC; }
+        SampleProgress(&Progress);
 
-    CheckSum.Sum += FileSize;
-    if (PrintFileSigs) {
-        ClearProgressInd();
-        _tprintf(TEXT("%08x%08x %10llu %s\n"), CheckSum.Crc, CheckSum.Sum, FileSize, FileName);
+        // Rates smoothed over the last second or so.
+        Now = GetTickCount();
+        Seconds = (Now - Last) / 1000.0;
+        if (Seconds > 0){
+            FileRate = FileRate * 0.7 + (Progress.FilesScanned - LastFiles) / Seconds * 0.3;
+            ByteRate = ByteRate * 0.7 + (Progress.BytesRead - LastRead) / Seconds * 0.3;
+        }
+        Last = Now;
+        LastFiles = Progress.FilesScanned;
+        LastRead = Progress.BytesRead;
+        Progress.FilesPerSecond = FileRate;
+        Progress.BytesPerSecond = ByteRate;
+
+        PollControlFile();
+        if (Ctx->OnProgress) Ctx->OnProgress(Ctx->User, &Progress);
+
+        EnterCriticalSection(&Ctx->ConsoleLock);
+        HoldsConsole = 1;
+        PollTimingRequest();
+        if (Ctx->ShowProgress && !Ctx->OnProgress && !Ctx->OnOutput) ShowProgressLine(&Progress);
+        fflush(stdout);
+        HoldsConsole = 0;
+        LeaveCriticalSection(&Ctx->ConsoleLock);
     }
+    return 0;
+}
 
-    return CheckSum;
+static void StartProgress(void)
+{
+    Ctx->ProgressStop = CreateEvent(NULL, TRUE, FALSE, NULL);
+    Ctx->ProgressThread = (HANDLE)_beginthreadex(NULL, 0, ProgressWorker, Ctx, 0, NULL);
+    if (Ctx->ProgressThread) InterlockedIncrement(&Ctx->ConsoleShared);
 }
 
-BOOL OpenTheFile(const TCHAR* FileName, HANDLE* FileHandle)
+static void StopProgress(void)
 {
-    *FileHandle = CreateFile(FileName,
-        GENERIC_READ,         // dwDesiredAccess
-        FILE_SHARE_READ,      // dwShareMode
-        NULL,                 // Security attributes
-        OPEN_EXISTING,        // dwCreationDisposition
-        FILE_ATTRIBUTE_NORMAL,// dwFlagsAndAttributes.  Ignored for opening existing files
-        NULL);                // hTemplateFile.  Ignored for existing.
-    if (*FileHandle == (void*)-1) {
-    cant_read_file:
-        DupeStats.CantReadFiles += 1;
-        if (!HideCantReadMessage) {
-            ClearProgressInd();
-            _ftprintf(stderr, TEXT("Could not read '%s'\n"), FileName);
-        }
-        return FALSE;
+    ReleaseConsole(); // The thread may be waiting for it.
+    if (Ctx->ProgressThread){
+        SetEvent(Ctx->ProgressStop);
+        WaitForSingleObject(Ctx->ProgressThread, INFINITE);
+        CloseHandle(Ctx->ProgressThread);
+        Ctx->ProgressThread = NULL;
+        InterlockedDecrement(&Ctx->ConsoleShared);
     }
-    return TRUE;
+    if (Ctx->ProgressStop){
+        CloseHandle(Ctx->ProgressStop);
+        Ctx->ProgressStop = NULL;
+    }
+    ClearProgressInd();
 }
 
 //--------------------------------------------------------------------------
-// Do selected operations to one file at a time.
+// Print one group of hardlinked instances (hardlink search mode).
 //--------------------------------------------------------------------------
-static void ProcessFile(const TCHAR* FileName)
+static void PrintLinkGroup(LinkGroup_t * Group)
 {
-    UINT64 FileSize;
-    Checksum_t CheckSum;
-    DWORD ticksCompare = 0;
-    DWORD ticksPrint = 0;
-    DWORD ticksFileInfo = 0;
-    DWORD ticksByteRead = 0;
-    DWORD ticksCRC = 0;
-
-    if (MeasureDurations) ticksCompare = GetTickCount();
-
-    // replace linear list search with hashset lookup
-    INT64 crc = CalcFilenameCRC(FileName);
-    int created;
-    khiter_t k = kh_get_fn(crc, 0, &created);
-    if (k != kh_end(FilenameSet))
-    {
+    FileData_t *t;
+    FileData_t *From;
+    LONGLONG Start;
+    int a = 0;
+
+    // Instances found after the group was printed are printed on their own,
+    // and the group is only counted once.
+    if (Group->Printed == NULL){
+        From = Group->First;
+        Ctx->DupeStats.HardlinkGroups += 1;
+    }else{
+        From = Group->Printed->Next;
+    }
+    Group->Printed = Group->Last;
+
+    if (Ctx->OnGroup){
+        if (From != Group->First){
+            Ctx->GroupMembers = GrowArray(Ctx->GroupMembers, &Ctx->GroupMembersAlloc, a+1, sizeof(FileData_t*));
+            Ctx->GroupMembers[a++] = Group->First;
+        }
+        for (t = From; t != NULL; t = t->Next) {
+            Ctx->GroupMembers = GrowArray(Ctx->GroupMembers, &Ctx->GroupMembersAlloc, a+1, sizeof(FileData_t*));
+            Ctx->GroupMembers[a++] = t;
+        }
+        ReportGroup(Ctx->GroupMembers, a);
         return;
     }
 
-    if (MeasureDurations) { ticksCompare = GetTickCount() - ticksCompare; totalCompare += ticksCompare; }
+    Start = TimerStart();
+    ClearProgressInd();
+    if (From == Group->First){
+        Print(TEXT("\nHardlink group, %d of %d hardlinked instances found in search tree:\n"), 
+            Group->Found, Group->First->NumLinks);
+    }else{
+        Print(TEXT("\nMore instances hardlinked to \"%s\", %d of %d found in search tree:\n"), 
+            Group->First->FileName, Group->Found, Group->First->NumLinks);
+    }
+    for (t = From; t != NULL; t = t->Next) {
+        Print(TEXT("  \"%s\"\n"), t->FileName);
+    }
+    TimerStop(STAGE_OUTPUT, Start);
+}
 
-    FileData_t ThisFile;
-    memset(&ThisFile, 0, sizeof(ThisFile));
-    {
-        static int LastPrint, Now;
-        Now = GetTickCount();
-        if ((unsigned)(Now-LastPrint) > 200){
-            if (ShowProgress){
-                TCHAR ShowName[55];
-                int l = _tcslen(FileName);
-                #ifdef UNICODE
-                wmemset(ShowName, L'\0', sizeof(ShowName) / sizeof(ShowName[0]));
-                #else
-                memset(ShowName, ' ', sizeof(ShowName));
-                #endif
-                if (l > 53) l = 53;
-                #ifdef UNICODE
-                wmemcpy(ShowName, FileName, l);
-                if (l >= 53) wmemcpy(ShowName + 53, L"…", 1);
-                #else
-                memcpy(ShowName, FileName, l);
-                if (l >= 53) memcpy(ShowName + 53, "…", 1);
-                #endif
-
-                _tprintf(TEXT("Scanned %4d files: %s\r"), FilesMatched, ShowName);
-                LastPrint = Now;
-                ProgressIndicatorVisible = 1;
-            }
-            fflush(stdout);
-            if (MeasureDurations) { ticksPrint = GetTickCount() - Now; totalPrint += ticksPrint; }
-        }
+//--------------------------------------------------------------------------
+// Add a file to its hardlink group.  A group is printed as soon as all its
+// links have been found, the rest, and any instances found after that, are
+// printed after the scan.
+//--------------------------------------------------------------------------
+static void StoreLinkGroupMember(FileData_t ThisFile, DWORD Volume, khint_t PathHash)
+{
+    FileId_t Id;
+    LinkGroup_t * Group;
+    FileData_t * Stored;
+    khiter_t k;
+    int ret;
+
+    Id.Volume = Volume;
+    Id.High = ThisFile.FileIndex.High;
+    Id.Low = ThisFile.FileIndex.Low;
+
+    k = kh_put(hlink, Ctx->LinkGroupMap, Id, &ret);
+    if (ret == -1) {
+        PrintError(TEXT("error storing new hardlink group"));
+        Fatal();
+    }
+    Group = &kh_value(Ctx->LinkGroupMap, k);
+    if (ret != 0) {
+        memset(Group, 0, sizeof(LinkGroup_t));
+    }
+
+    ThisFile.Next = NULL;
+    Stored = NewFileData(ThisFile);
+    if (Group->First == NULL) {
+        Group->First = Stored;
+    } else {
+        Group->Last->Next = Stored;
     }
+    Group->Last = Stored;
+    Group->Found += 1;
 
-    FilesMatched += 1;
+    AddKnownPath(Stored->FileName, PathHash);
 
-    if (BatchFileName && _tcscmp(FileName, BatchFileName) == 0) return;
+    if (Group->Printed == NULL && Group->Found >= Group->First->NumLinks) {
+        PrintLinkGroup(Group);
+    }
+}
 
-    // removed stat function was only used for getting file size, so use below FS access
+//--------------------------------------------------------------------------
+// Do selected operations to one file at a time.  The body is expanded once
+// per mode, with the PF_ flags as constants, so the options are not checked
+// again for every file and each mode only has its own work in it.  RunScan
+// picks the expansion for each file pattern (SelectProcessFile).
+//--------------------------------------------------------------------------
+#define PF_LINKS    1   // Hardlink search mode (-listlink)
+#define PF_FILTER   2   // Leave out -ign matches and the -bat, -trace and -metrics files
+#define PF_REF      4   // All files of the pattern are reference files
+#define PF_REFDIRS  8   // Files may be in directories of earlier -ref patterns
+
+static __forceinline void ProcessFileAs(const GlobEntry_t* Entry, const int Mode)
+{
+    const TCHAR* FileName = Entry->FileName;
 
-    // skip if filename contains a ignore pattern
-    for (int i = 0; i < IgnorePatternsCount; i++)
+    if (HoldsConsole) ReleaseConsole(); // Let the progress thread back in after messages.
+
+    khint_t PathHash = TStrHash(FileName);
+    if (IsKnownPath(FileName, PathHash))
     {
-        if (StrStrI(FileName, IgnorePatterns[i]))
+        return;
+    }
+
+    FileData_t ThisFile;
+    memset(&ThisFile, 0, sizeof(ThisFile));
+
+    Ctx->FilesMatched += 1;
+    Ctx->FilesScanned += 1;
+
+    if (Mode & PF_FILTER){
+        if (Ctx->BatchFileName && _tcscmp(FileName, Ctx->BatchFileName) == 0) return;
+        if (Ctx->TraceFileName && _tcscmp(FileName, Ctx->TraceFileName) == 0) return;
+        if (Ctx->MetricsFileName && _tcsncmp(FileName, Ctx->MetricsFileName, _tcslen(Ctx->MetricsFileName)) == 0) return;
+
+        // skip if filename contains a ignore pattern
+        for (int i = 0; i < Ctx->IgnorePatternsCount; i++)
         {
-            DupeStats.IgnoredFiles++;
-            ThisFile.FileName = _tcsdup(FileName);
-            StoreFileData(ThisFile, crc);
-            return;
+            if (StrStrI(FileName, Ctx->IgnorePatterns[i]))
+            {
+                Ctx->DupeStats.IgnoredFiles++;
+                AddKnownPath(KeepName(FileName), PathHash);
+                return;
+            }
         }
     }
 
-    HANDLE FileHandle;
-    {
-        if (MeasureDurations) ticksFileInfo = GetTickCount();
+    // removed stat function was only used for getting file size, so use below FS access
 
+    if (Mode & PF_LINKS){
+        HANDLE FileHandle = NULL;
         BY_HANDLE_FILE_INFORMATION FileInfo;
-        if (!OpenTheFile(FileName, &FileHandle)) return;
-        GetFileInformationByHandle(FileHandle, &FileInfo);
 
-        //CloseHandle(FileHandle);
-
-        if (MeasureDurations) { ticksFileInfo = GetTickCount() - ticksFileInfo; totalFileInfo += ticksFileInfo; }
-
-        if (Verbose){
-            ClearProgressInd();
-            _tprintf(TEXT("Hardlinked (%d links) node=%08x %08x: %s\n"), FileInfo.nNumberOfLinks, 
-                FileInfo.nFileIndexHigh, FileInfo.nFileIndexLow, FileName);
-        }
+        // Hardlink search needs the link count of every file, so open it.
+        if (!ReadFileInfo(FileName, &FileHandle, &FileInfo)) return;
+        CloseHandle(FileHandle);
 
-        if (HardlinkSearchMode && FileInfo.nNumberOfLinks == 1){
+        if (FileInfo.nNumberOfLinks == 1){
             // File has only one link, so its not hardlinked.  Skip for hardlink search mode.
-            CloseHandle(FileHandle);
             return;
         }
 
-        //_tprintf(TEXT("    Info:  Index: %08x %08x\n"),FileInfo.nFileIndexHigh, FileInfo.nFileIndexLow);
-
-        // Use the file index (which is NTFS equivalent of the iNode) instead of the CRC.
-        ThisFile.FileIndex.Low      = FileInfo.nFileIndexLow;
-        ThisFile.FileIndex.High     = FileInfo.nFileIndexHigh;
-        ThisFile.NumLinks = FileInfo.nNumberOfLinks;
-        ThisFile.Larger = NULL;
-        ThisFile.Smaller = NULL;
+        SetFileInfo(&ThisFile, &FileInfo);
         ULARGE_INTEGER ul;
         ul.HighPart = FileInfo.nFileSizeHigh;
         ul.LowPart = FileInfo.nFileSizeLow;
-        FileSize = ul.QuadPart;
-        ThisFile.FileSize = FileSize;
-
-        if (FileSize == 0) {
-            if (SkipZeroLength) {
-                DupeStats.ZeroLengthFiles += 1;
-                CloseHandle(FileHandle);
-                return;
-            }
+        ThisFile.FileSize = ul.QuadPart;
+        if (ThisFile.FileSize == 0 && Ctx->SkipZeroLength) {
+            Ctx->DupeStats.ZeroLengthFiles += 1;
+            return;
         }
 
-        if (HardlinkSearchMode){
-            // For hardlink search mode, duplicates are detected by file index, not CRC,
-            // so copy the file ID into the CRC.
-            ThisFile.Checksum.Sum = ThisFile.FileIndex.Low;
-            ThisFile.Checksum.Crc = ThisFile.FileIndex.High;
+        // For hardlink search mode, files are grouped by file index directly,
+        // no signatures or search tree needed.
+        Ctx->DupeStats.TotalFiles += 1;
+        Ctx->DupeStats.TotalBytes += ThisFile.FileSize;
+        ThisFile.FileName = KeepName(FileName);
+        StoreLinkGroupMember(ThisFile, FileInfo.dwVolumeSerialNumber, PathHash);
+        return;
+    }
+
+    // The size comes from the directory listing.  Files are opened after the
+    // scan, and only if another file of the same size was found.
+    ThisFile.FileSize = Entry->FileSize;
+
+    if (ThisFile.FileSize == 0) {
+        if (Ctx->SkipZeroLength) {
+            Ctx->DupeStats.ZeroLengthFiles += 1;
+            return;
         }
     }
 
-    FileData_t * Ptr = NULL;
-    int found;
-    khiter_t k_fd = kh_get_fd(ThisFile.FileSize, 0, &found);
-    if (found)
-        Ptr = kh_value(FileDataMap, k_fd);
-
-    if (!HardlinkSearchMode) {
-        if (found) {
-            if (Ptr->Checksum.Crc == 0) {
-                HANDLE rootHandle = 0;
-                if (!OpenTheFile(Ptr->FileName, &rootHandle)) return;
-                Ptr->Checksum = ReadFileAndCalculateCRC32KB(rootHandle, Ptr->FileName, Ptr->FileSize);
-                CloseHandle(rootHandle);
-            }
+    // Decide once per file whether it may be eliminated.
+    #ifdef REF_CODE
+    ThisFile.IsReference = (Mode & PF_REF) || ((Mode & PF_REFDIRS) && !IsNonRefPath(FileName));
+    #else
+    ThisFile.IsReference = (Mode & PF_REF) != 0;
+    #endif
+
+    ThisFile.FileName = KeepName(FileName); // keep the string last, so
+                                           // we don't waste memory on errors.
+
+    Ctx->DupeStats.TotalFiles += 1;
+    Ctx->DupeStats.TotalBytes += (__int64)ThisFile.FileSize;
+
+    StoreFileData(ThisFile, PathHash);
+}
+
+static void ProcessFileDupes(const GlobEntry_t* Entry)         { ProcessFileAs(Entry, 0); }
+static void ProcessFileDupesFiltered(const GlobEntry_t* Entry) { ProcessFileAs(Entry, PF_FILTER); }
+static void ProcessFileRef(const GlobEntry_t* Entry)           { ProcessFileAs(Entry, PF_REF); }
+static void ProcessFileRefFiltered(const GlobEntry_t* Entry)   { ProcessFileAs(Entry, PF_REF | PF_FILTER); }
+static void ProcessFileRefDirs(const GlobEntry_t* Entry)       { ProcessFileAs(Entry, PF_REFDIRS); }
+static void ProcessFileRefDirsFiltered(const GlobEntry_t* Entry) { ProcessFileAs(Entry, PF_REFDIRS | PF_FILTER); }
+static void ProcessFileLinks(const GlobEntry_t* Entry)         { ProcessFileAs(Entry, PF_LINKS); }
+static void ProcessFileLinksFiltered(const GlobEntry_t* Entry) { ProcessFileAs(Entry, PF_LINKS | PF_FILTER); }
+
+//--------------------------------------------------------------------------
+// Pick the expansion of ProcessFileAs for the next file pattern.  Reference
+// directories are only known after a -ref pattern was scanned.
+//--------------------------------------------------------------------------
+static GlobFunc_t SelectProcessFile(void)
+{
+    int Filter = Ctx->BatchFileName || Ctx->TraceFileName || Ctx->MetricsFileName || Ctx->IgnorePatternsCount;
+
+    if (Ctx->HardlinkSearchMode){
+        return Filter ? ProcessFileLinksFiltered : ProcessFileLinks;
+    }
+    if (Ctx->ReferenceFiles){
+        return Filter ? ProcessFileRefFiltered : ProcessFileRef;
+    }
+    #ifdef REF_CODE
+    if (kh_size(Ctx->RefDirSet) != 0){
+        return Filter ? ProcessFileRefDirsFiltered : ProcessFileRefDirs;
+    }
+    #endif
+    return Filter ? ProcessFileDupesFiltered : ProcessFileDupes;
+}
 
-            ThisFile.Checksum = ReadFileAndCalculateCRC32KB(FileHandle, FileName, FileSize);
+//--------------------------------------------------------------------------
+// Parse a size with optional k, m or g suffix.
+//--------------------------------------------------------------------------
+static UINT64 ParseSize(const TCHAR * Str, TCHAR ** End)
+{
+    UINT64 Size = _tcstoui64(Str, End, 10);
+    switch (tolower(**End)){
+        case 'k': Size <<= 10; (*End)++; break;
+        case 'm': Size <<= 20; (*End)++; break;
+        case 'g': Size <<= 30; (*End)++; break;
+    }
+    return Size;
+}
+
+//--------------------------------------------------------------------------
+// Parse the list of comparison tiers, eg. head:4k,tail:32k,sample:4:64k
+//--------------------------------------------------------------------------
+static void ParseTiers(const TCHAR * Spec)
+{
+    const TCHAR * p = Spec;
+    TCHAR * End;
+
+    Ctx->NumTiers = 0;
+    while (*p){
+        Tier_t * Tier;
+        if (Ctx->NumTiers >= MAX_TIERS) goto bad;
+        Tier = &Ctx->Tiers[Ctx->NumTiers++];
+        memset(Tier, 0, sizeof(Tier_t));
+        Tier->Blocks = 1;
+
+        if (!_tcsncmp(p, TEXT("head:"), 5)){
+            Tier->Kind = TIER_HEAD;
+            p += 5;
+        }else if (!_tcsncmp(p, TEXT("tail:"), 5)){
+            Tier->Kind = TIER_TAIL;
+            p += 5;
+        }else if (!_tcsncmp(p, TEXT("sample:"), 7)){
+            Tier->Kind = TIER_SAMPLE;
+            Tier->Blocks = _tcstol(p + 7, &End, 10);
+            if (*End != ':' || Tier->Blocks < 1 || Tier->Blocks > 64) goto bad;
+            p = End + 1;
+        }else{
+            goto bad;
         }
+        Tier->Bytes = ParseSize(p, &End);
+        if (Tier->Bytes == 0 || (*End != ',' && *End != '\0')) goto bad;
+        p = (*End == ',') ? End + 1 : End;
     }
-    CloseHandle(FileHandle);
+    if (Ctx->NumTiers) return;
+
+    bad:
+    PrintError(TEXT("Invalid tier list '%s'.  Use -h for help\n"), Spec);
+    Fatal();
+}
 
-    ThisFile.FileName = _tcsdup(FileName); // allocate the string last, so 
-                                          // we don't waste memory on errors.
+//--------------------------------------------------------------------------
+// Parse the list of cache hints, eg. seq,prefetch,drop
+//--------------------------------------------------------------------------
+static void ParseCacheHints(const TCHAR * Spec)
+{
+    const TCHAR * p = Spec;
+
+    Ctx->CacheHints = 0;
+    while (*p){
+        size_t l = _tcscspn(p, TEXT(","));
+        if (l == 3 && !_tcsncmp(p, TEXT("seq"), 3)){
+            Ctx->CacheHints |= CACHE_SEQUENTIAL;
+        }else if (l == 8 && !_tcsncmp(p, TEXT("prefetch"), 8)){
+            Ctx->CacheHints |= CACHE_PREFETCH;
+        }else if (l == 4 && !_tcsncmp(p, TEXT("drop"), 4)){
+            Ctx->CacheHints |= CACHE_DROP;
+        }else if (l != 4 || _tcsncmp(p, TEXT("none"), 4)){
+            PrintError(TEXT("Invalid cache hints '%s'.  Use -h for help\n"), Spec);
+            Fatal();
+        }
+        p += l;
+        if (*p == ',') p++;
+    }
+}
 
-    CheckDuplicate(Ptr, ThisFile, crc);
+//--------------------------------------------------------------------------
+// Print how many files each comparison tier ruled out.
+//--------------------------------------------------------------------------
+static void PrintTierStats(void)
+{
+    int t;
+
+    Print(TEXT("\nTier                    Groups    Files     Read  Ruled out  kBytes read\n"));
+    for (t = 0; t <= Ctx->NumTiers; t++){
+        Tier_t * Tier = &Ctx->Tiers[t];
+        TCHAR Name[32];
+        if (Tier->Kind == TIER_FULL){
+            _sntprintf(Name, 32, TEXT("%s"), TierNames[Tier->Kind]);
+        }else if (Tier->Kind == TIER_SAMPLE){
+            _sntprintf(Name, 32, TEXT("%s %dx%llu"), TierNames[Tier->Kind], Tier->Blocks, Tier->Bytes);
+        }else{
+            _sntprintf(Name, 32, TEXT("%s %llu"), TierNames[Tier->Kind], Tier->Bytes);
+        }
+        Print(TEXT("%-22s %7d %8d %8d %10d %12llu\n"), Name, Tier->Groups, Tier->Files,
+            Tier->FilesRead, Tier->RuledOut, Tier->BytesRead / 1024);
+    }
 
-    if (MeasureDurations) {
-        _tprintf(TEXT("Cmp: %d / %d Print: %d / %d FS: 0 / 0 FI: %d / %d BR: %d / %d CRC: %d / %d CHK: %d / %d  =  %d\n"),
-            ticksCompare, totalCompare, ticksPrint, totalPrint, ticksFileInfo, totalFileInfo, ticksByteRead, totalByteRead, ticksCRC, totalCRC, ticksCheck, totalCheck,
-            (totalCompare + totalPrint + totalFileInfo + totalByteRead + totalCRC + totalCheck));
+    if (Ctx->PrefixChanged){
+        Print(TEXT("\nHead length by file size:\n"));
+        for (t = 0; t < 64; t++){
+            if (Ctx->PrefixBytes[t] != Ctx->Tiers[0].Bytes){
+                Print(TEXT("  %12llu - %12llu bytes: %llu\n"), (UINT64)1 << t,
+                    ((UINT64)2 << t) - 1, Ctx->PrefixBytes[t]);
+            }
+        }
     }
 }
 
@@ -927,19 +3181,20 @@ static void ProcessFile(const TCHAR* FileName)
 //--------------------------------------------------------------------------
 static void Usage (void)
 {
-    _tprintf(TEXT("finddupe v%s compiled %s\n"), TEXT(VERSION), TEXT(__DATE__));
-    _tprintf(TEXT("an enhanced version by thomas694 (@GH), originally by Matthias Wandel\n"));
-    _tprintf(TEXT("This program comes with ABSOLUTELY NO WARRANTY. This is free software, and you\n"));
-    _tprintf(TEXT("are welcome to redistribute it under certain conditions; view GNU GPLv3 for more.\n\n"));
-    _tprintf(TEXT("Usage: finddupe [options] [-ign <substr> ...] [-ref <filepat> ...] <filepat>...\n"));
-    _tprintf(TEXT("Options:\n")
+    Print(TEXT("finddupe v%s compiled %s\n"), TEXT(VERSION), TEXT(__DATE__));
+    Print(TEXT("an enhanced version by thomas694 (@GH), originally by Matthias Wandel\n"));
+    Print(TEXT("This program comes with ABSOLUTELY NO WARRANTY. This is free software, and you\n"));
+    Print(TEXT("are welcome to redistribute it under certain conditions; view GNU GPLv3 for more.\n\n"));
+    Print(TEXT("Usage: finddupe [options] [-ign <substr> ...] [-ign-dir <dirpat> ...] [-ref <filepat> ...] <filepat>...\n"));
+    Print(TEXT("Options:\n")
            TEXT(" -bat <file.bat> Create batch file with commands to do the hard\n")
            TEXT("                 linking.  run batch file afterwards to do it\n")
            TEXT(" -hardlink       Create hardlinks.  Works on NTFS file systems only.\n")
            TEXT("                 Use with caution!\n")
            TEXT(" -del            Delete duplicate files\n")
            TEXT(" -v              Verbose\n")
-           TEXT(" -sigs           Show signatures calculated based on first 32k for each file\n")
+           TEXT(" -sigs           Show signatures calculated based on first 32k (or the first\n")
+           TEXT("                 tier given with -tiers) for each file\n")
            TEXT(" -rdonly         Apply to readonly files also (as opposed to skipping them)\n")
            TEXT(" -z              Do not skip zero length files (zero length files are ignored\n")
            TEXT("                 by default)\n")
@@ -947,9 +3202,35 @@ static void Usage (void)
            TEXT(" -sl             Skip linked duplicates and show only unlinked ones\n")
            TEXT(" -p              Hide progress indicator (useful when redirecting to a file)\n")
            TEXT(" -j              Follow NTFS junctions and reparse points (off by default)\n")
+           TEXT(" -threads <n>    Number of files to read at once when comparing candidates\n")
+           TEXT("                 (default: number of processors, max. 8).  Applies per disk\n")
+           TEXT(" -hddthreads <n> Number of files to read at once on a spinning disk (default: 1)\n")
+           TEXT(" -maxmb <n>      Read at most n MB per second\n")
+           TEXT(" -maxopen <n>    Open at most n files per second\n")
+           TEXT(" -control <file> Take -maxmb and -maxopen from lines maxmb=<n> and maxopen=<n>\n")
+           TEXT("                 in this file, re-read when it changes while running\n")
+           TEXT(" -idle           Read with background priority, to keep out of the way of others\n")
+           TEXT(" -cache <hints>  File cache hints for the full compare, comma separated: seq\n")
+           TEXT("                 (sequential read-ahead), prefetch (start reading the next\n")
+           TEXT("                 file early), drop (purge files from the cache once read),\n")
+           TEXT("                 or none (default: seq,prefetch)\n")
+           TEXT(" -direct         Read past the file cache, for cold archive scans.  Falls back\n")
+           TEXT("                 to normal reads where the file system does not allow it\n")
+           TEXT(" -tiers <list>   Comparison steps before the full compare, comma separated:\n")
+           TEXT("                 head:<size>, tail:<size> or sample:<blocks>:<size>\n")
+           TEXT("                 (default: head:32k)\n")
+           TEXT(" -stats          Show how many files each comparison step ruled out\n")
+           TEXT(" -timing         Time each stage and show totals and latency histograms at the\n")
+           TEXT("                 end.  Ctrl+Break shows them while running\n")
+           TEXT(" -trace <file>   Write the timed stages of each thread to file, in Chrome\n")
+           TEXT("                 trace format (for chrome://tracing or ui.perfetto.dev)\n")
+           TEXT(" -metrics <file> Write counters and gauges for the Prometheus textfile collector\n")
+           TEXT("                 to file (name it *.prom), every 15 seconds and at the end\n")
            TEXT(" -listlink       hardlink list mode.  Not valid with -del, -bat, -hardlink,\n")
            TEXT("                 or -rdonly, options\n")
            TEXT(" -ign <substr>   Ignore file pattern, eg. .bak or .tmp (repeatable)\n")
+           TEXT(" -ign-dir <dirpat> Do not descend into directories whose name matches, eg. .git\n")
+           TEXT("                 or node_modules.  Wildcards allowed (repeatable)\n")
            TEXT(" -ref <filepat>  Following file pattern are files that are for reference, NOT to\n")
            TEXT("                 be eliminated, only used to check duplicates against (repeatable)\n")
            TEXT(" filepat         Pattern for files.  Examples:\n")
@@ -959,12 +3240,11 @@ static void Usage (void)
            TEXT("                                from current directory down\n")
            
            );
-    exit(EXIT_FAILURE);
 }
 
 static void CheckFileSystem(TCHAR drive)
 {
-    if (!(BatchFileName || MakeHardLinks)) return;
+    if (!(Ctx->BatchFileName || Ctx->MakeHardLinks)) return;
 
     TCHAR lpRootPathName[4];
     _tcsncpy(lpRootPathName, TEXT("C:\\\0"), 4);
@@ -980,46 +3260,30 @@ static void CheckFileSystem(TCHAR drive)
     if (_tcscmp(lpFileSystemNameBuffer, TEXT("NTFS")))
     {
         ClearProgressInd();
-        _ftprintf(stderr, TEXT("finddupe can only make hardlinks on NTFS filesystems\n"));
-        exit(EXIT_FAILURE);
+        PrintError(TEXT("finddupe can only make hardlinks on NTFS filesystems\n"));
+        Fatal();
     }
 }
 
 //--------------------------------------------------------------------------
-// The main program.
+// Parse the options.  The file patterns, and -ref with its patterns, are
+// kept for the scan.
 //--------------------------------------------------------------------------
-int _tmain (int argc, TCHAR **argv)
+static int ParseOptions(int argc, TCHAR **argv)
 {
     int argn;
     TCHAR * arg;
-    TCHAR DefaultDrive;
-    TCHAR DriveUsed = '\0';
     int indexFirstRef = 0;
-    
-    PrintDuplicates = 1;
-    PrintFileSigs = 0;
-    HardlinkSearchMode = 0;
-    Verbose = 0;
-
-    _tsetlocale(LC_CTYPE, TEXT(".UTF8"));
-#ifdef UNICODE
-    _setmode(_fileno(stdout), _O_U16TEXT);
-    _setmode(_fileno(stderr), _O_U16TEXT);
-#endif
-
-    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
-    DWORD mode = 0;
-    GetConsoleMode(hConsole, &mode);
-    NewConsoleMode = SetConsoleMode(hConsole, mode | ENABLE_PROCESSED_OUTPUT | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
 
     for (argn = 1; argn < argc; argn++) {
         arg = argv[argn];
         if (indexFirstRef == 0 && !_tcscmp(arg, TEXT("-ref"))) indexFirstRef = argn;
         if (indexFirstRef > 0 && (!_tcscmp(arg, TEXT("-bat")) || !_tcscmp(arg, TEXT("-v")) || !_tcscmp(arg, TEXT("-sigs")) || !_tcscmp(arg, TEXT("-hardlink")) ||
             !_tcscmp(arg, TEXT("-del")) || !_tcscmp(arg, TEXT("-rdonly")) || !_tcscmp(arg, TEXT("-listlink")) || !_tcscmp(arg, TEXT("-z")) || !_tcscmp(arg, TEXT("-u")) ||
-            !_tcscmp(arg, TEXT("-sl")) || !_tcscmp(arg, TEXT("-p")) || !_tcscmp(arg, TEXT("-j")) || !_tcscmp(arg, TEXT("-ign"))) && argn > indexFirstRef) {
-            _ftprintf(stderr, TEXT("Wrong order of options!  Use -h for help\n"));
-            exit(EXIT_FAILURE);
+            !_tcscmp(arg, TEXT("-sl")) || !_tcscmp(arg, TEXT("-p")) || !_tcscmp(arg, TEXT("-j")) || !_tcscmp(arg, TEXT("-threads")) || !_tcscmp(arg, TEXT("-hddthreads")) || !_tcscmp(arg, TEXT("-maxmb")) || !_tcscmp(arg, TEXT("-maxopen")) ||
+            !_tcscmp(arg, TEXT("-control")) || !_tcscmp(arg, TEXT("-idle")) || !_tcscmp(arg, TEXT("-cache")) || !_tcscmp(arg, TEXT("-direct")) || !_tcscmp(arg, TEXT("-tiers")) || !_tcscmp(arg, TEXT("-stats")) || !_tcscmp(arg, TEXT("-timing")) || !_tcscmp(arg, TEXT("-trace")) || !_tcscmp(arg, TEXT("-metrics")) || !_tcscmp(arg, TEXT("-ign")) || !_tcscmp(arg, TEXT("-ign-dir"))) && argn > indexFirstRef) {
+            PrintError(TEXT("Wrong order of options!  Use -h for help\n"));
+            return EXIT_FAILURE;
         }
     }
 
@@ -1029,106 +3293,235 @@ int _tmain (int argc, TCHAR **argv)
 
         if (!_tcscmp(arg,TEXT("-h"))){
             Usage();
-            exit(EXIT_FAILURE);
+            return EXIT_FAILURE;
         }else if (!_tcscmp(arg,TEXT("-bat"))){
-            BatchFileName = argv[++argn];
+            Ctx->BatchFileName = argv[++argn];
         }else if (!_tcscmp(arg,TEXT("-v"))){
-            PrintDuplicates = 1;
-            PrintFileSigs = 1;
-            Verbose = 1;
-            HideCantReadMessage = 0;
+            Ctx->PrintDuplicates = 1;
+            Ctx->PrintFileSigs = 1;
+            Ctx->Verbose = 1;
+            Ctx->HideCantReadMessage = 0;
         }else if (!_tcscmp(arg,TEXT("-sigs"))){
-            PrintDuplicates = 0;
-            PrintFileSigs = 1;
+            Ctx->PrintDuplicates = 0;
+            Ctx->PrintFileSigs = 1;
         }else if (!_tcscmp(arg,TEXT("-hardlink"))){
-            MakeHardLinks = 1;
+            Ctx->MakeHardLinks = 1;
         }else if (!_tcscmp(arg,TEXT("-del"))){
-            DelDuplicates = 1;
+            Ctx->DelDuplicates = 1;
         }else if (!_tcscmp(arg,TEXT("-rdonly"))){
-            DoReadonly = 1;
+            Ctx->DoReadonly = 1;
         }else if (!_tcscmp(arg,TEXT("-listlink"))){
-            HardlinkSearchMode = 1;
+            Ctx->HardlinkSearchMode = 1;
         }else if (!_tcscmp(arg,TEXT("-ref"))){
             break;
         }else if (!_tcscmp(arg,TEXT("-z"))){
-            SkipZeroLength = 0;
+            Ctx->SkipZeroLength = 0;
         }else if (!_tcscmp(arg,TEXT("-u"))){
-            HideCantReadMessage = 1;
+            Ctx->HideCantReadMessage = 1;
         }else if (!_tcscmp(arg,TEXT("-sl"))) {
-            SkipLinkedDuplicates = 1;
+            Ctx->SkipLinkedDuplicates = 1;
         }else if (!_tcscmp(arg,TEXT("-p"))){
-            ShowProgress = 0;
+            Ctx->ShowProgress = 0;
         }else if (!_tcscmp(arg,TEXT("-j"))){
-            FollowReparse = 1;
+            Ctx->FollowReparse = 1;
+        }else if (!_tcscmp(arg,TEXT("-threads"))){
+            if (++argn >= argc) break;
+            Ctx->NumThreads = _ttoi(argv[argn]);
+            if (Ctx->NumThreads < 1 || Ctx->NumThreads > MAXIMUM_WAIT_OBJECTS){
+                PrintError(TEXT("Number of threads must be between 1 and %d\n"), MAXIMUM_WAIT_OBJECTS);
+                return EXIT_FAILURE;
+            }
+        }else if (!_tcscmp(arg,TEXT("-hddthreads"))){
+            if (++argn >= argc) break;
+            Ctx->HddThreads = _ttoi(argv[argn]);
+            if (Ctx->HddThreads < 1 || Ctx->HddThreads > MAXIMUM_WAIT_OBJECTS){
+                PrintError(TEXT("Number of threads must be between 1 and %d\n"), MAXIMUM_WAIT_OBJECTS);
+                return EXIT_FAILURE;
+            }
+        }else if (!_tcscmp(arg,TEXT("-maxmb"))){
+            if (++argn >= argc) break;
+            Ctx->ReadBytesLimit.Rate = _tstof(argv[argn]) * 1024 * 1024;
+        }else if (!_tcscmp(arg,TEXT("-maxopen"))){
+            if (++argn >= argc) break;
+            Ctx->OpensLimit.Rate = _tstof(argv[argn]);
+        }else if (!_tcscmp(arg,TEXT("-control"))){
+            if (++argn >= argc) break;
+            Ctx->ControlFileName = argv[argn];
+        }else if (!_tcscmp(arg,TEXT("-idle"))){
+            Ctx->IdlePriority = 1;
+        }else if (!_tcscmp(arg,TEXT("-direct"))){
+            Ctx->DirectIO = 1;
+        }else if (!_tcscmp(arg,TEXT("-cache"))){
+            if (++argn >= argc) break;
+            ParseCacheHints(argv[argn]);
+        }else if (!_tcscmp(arg,TEXT("-tiers"))){
+            if (++argn >= argc) break;
+            ParseTiers(argv[argn]);
+        }else if (!_tcscmp(arg,TEXT("-stats"))){
+            Ctx->ShowStats = 1;
+        }else if (!_tcscmp(arg,TEXT("-timing"))){
+            Ctx->ShowTiming = 1;
+        }else if (!_tcscmp(arg,TEXT("-trace"))){
+            if (++argn >= argc) break;
+            Ctx->TraceFileName = argv[argn];
+        }else if (!_tcscmp(arg,TEXT("-metrics"))){
+            if (++argn >= argc) break;
+            Ctx->MetricsFileName = argv[argn];
         }
         else if (!_tcscmp(arg, TEXT("-ign"))) {
-            if (IgnorePatternsCount >= IgnorePatternsAlloc) {
+            if (++argn >= argc) break;
+            if (Ctx->IgnorePatternsCount >= Ctx->IgnorePatternsAlloc) {
+                // Array is full.  Make it bigger
+                Ctx->IgnorePatternsAlloc = Ctx->IgnorePatternsAlloc + 4;
+                Ctx->IgnorePatterns = realloc(Ctx->IgnorePatterns, sizeof(TCHAR*) * Ctx->IgnorePatternsAlloc);
+                if (Ctx->IgnorePatterns == NULL) {
+                    PrintError(TEXT("Malloc failure"));
+                    return EXIT_FAILURE;
+                }
+            };
+            TCHAR* substr = _tcsdup(argv[argn]);
+            Ctx->IgnorePatterns[Ctx->IgnorePatternsCount++] = substr;
+        }
+        else if (!_tcscmp(arg, TEXT("-ign-dir"))) {
+            if (++argn >= argc) break;
+            if (Ctx->IgnoreDirPatternsCount >= Ctx->IgnoreDirPatternsAlloc) {
                 // Array is full.  Make it bigger
-                IgnorePatternsAlloc = IgnorePatternsAlloc + 4;
-                IgnorePatterns = realloc(IgnorePatterns, sizeof(TCHAR*) * IgnorePatternsAlloc);
-                if (IgnorePatterns == NULL) {
-                    _ftprintf(stderr, TEXT("Malloc failure"));
-                    exit(EXIT_FAILURE);
+                Ctx->IgnoreDirPatternsAlloc = Ctx->IgnoreDirPatternsAlloc + 4;
+                Ctx->IgnoreDirPatterns = realloc(Ctx->IgnoreDirPatterns, sizeof(TCHAR*) * Ctx->IgnoreDirPatternsAlloc);
+                if (Ctx->IgnoreDirPatterns == NULL) {
+                    PrintError(TEXT("Malloc failure"));
+                    return EXIT_FAILURE;
                 }
             };
-            TCHAR* substr = _tcsdup(argv[++argn]);
-            IgnorePatterns[IgnorePatternsCount++] = substr;
+            TCHAR* dirpat = _tcsdup(argv[argn]);
+            Ctx->IgnoreDirPatterns[Ctx->IgnoreDirPatternsCount++] = dirpat;
         }else{
-            _tprintf(TEXT("Argument '%s' not understood.  Use -h for help.\n"), arg);
-            exit(-1);
+            Print(TEXT("Argument '%s' not understood.  Use -h for help.\n"), arg);
+            return -1;
         }
     }
 
     if (argn > argc){
-        _ftprintf(stderr, TEXT("Missing argument!  Use -h for help\n"));
-        exit(EXIT_FAILURE);
+        PrintError(TEXT("Missing argument!  Use -h for help\n"));
+        return EXIT_FAILURE;
     }
 
     if (argn == argc){
-        _ftprintf(stderr, TEXT("No files to process.   Use -h for help\n"));
-        exit(EXIT_FAILURE);
+        PrintError(TEXT("No files to process.   Use -h for help\n"));
+        return EXIT_FAILURE;
     }
 
-    if (HardlinkSearchMode){
-        if (BatchFileName || MakeHardLinks || DelDuplicates || DoReadonly){
-            _ftprintf(stderr, TEXT("listlink option is not valid with any other")
+    if (Ctx->HardlinkSearchMode){
+        if (Ctx->BatchFileName || Ctx->MakeHardLinks || Ctx->DelDuplicates || Ctx->DoReadonly){
+            PrintError(TEXT("listlink option is not valid with any other")
                 TEXT(" options other than -v\n"));
-            exit(EXIT_FAILURE);
+            return EXIT_FAILURE;
         }
     }
 
-    NumUnique = 0;
-    NumAllocated = UNITS_PER_ALLOCATION;
-    FileData = (FileData_t*)malloc(sizeof(FileData_t) * NumAllocated);
-    if (FileData == NULL){
-        _ftprintf(stderr, TEXT("Malloc failure"));
-        exit(EXIT_FAILURE);
+    // Copied, as the scan changes them.
+    Ctx->Patterns = (TCHAR **)calloc(argc - argn, sizeof(TCHAR *));
+    if (Ctx->Patterns == NULL){
+        PrintError(TEXT("Malloc failure"));
+        return EXIT_FAILURE;
+    }
+    for (; argn < argc; argn++){
+        Ctx->Patterns[Ctx->NumPatterns] = _tcsdup(argv[argn]);
+        if (Ctx->Patterns[Ctx->NumPatterns++] == NULL){
+            PrintError(TEXT("Malloc failure"));
+            return EXIT_FAILURE;
+        }
     }
+    return EXIT_SUCCESS;
+}
 
-    #ifdef REF_CODE
-    PathUnique = 0;
-    PathAllocated = 64;
-    PathData = (TCHAR**) malloc(sizeof(TCHAR*)*PathAllocated);
-    if (PathData == NULL){
-        _ftprintf(stderr, TEXT("Malloc failure"));
-        exit(EXIT_FAILURE);
+//--------------------------------------------------------------------------
+// Print the summary at the end of the scan.
+//--------------------------------------------------------------------------
+static void PrintSummary(void)
+{
+    if (Ctx->HardlinkSearchMode){
+        Print(TEXT("\nNumber of hardlink groups found: %d\n"), Ctx->DupeStats.HardlinkGroups);
+    }else{
+        // Print summary data
+        ClearProgressInd();
+        UINT64 totalBytes = ((UINT64)(Ctx->DupeStats.TotalBytes / 1024) == 0 && Ctx->DupeStats.TotalBytes > 0) ? 1 : Ctx->DupeStats.TotalBytes / 1024;
+        UINT64 duplicateBytes = ((UINT64)(Ctx->DupeStats.DuplicateBytes / 1024) == 0 && Ctx->DupeStats.DuplicateBytes > 0) ? 1 : Ctx->DupeStats.DuplicateBytes / 1024;
+        Print(TEXT("\n"));
+        Print(TEXT("Files: %8llu kBytes in %5d files\n"),
+                totalBytes, Ctx->DupeStats.TotalFiles);
+        Print(TEXT("Dupes: %8llu kBytes in %5d files\n"),
+                duplicateBytes, Ctx->DupeStats.DuplicateFiles);
+        if (Ctx->ShowStats) PrintTierStats();
+    }
+    if (Ctx->DupeStats.ZeroLengthFiles){
+        Print(TEXT("  %d files of zero length were skipped\n"), Ctx->DupeStats.ZeroLengthFiles);
+    }
+    if (Ctx->DupeStats.IgnoredFiles) {
+        Print(TEXT("  %d files were ignored\n"), Ctx->DupeStats.IgnoredFiles);
+    }
+    if (Ctx->DupeStats.IgnoredDirs) {
+        Print(TEXT("  %d directories were pruned\n"), Ctx->DupeStats.IgnoredDirs);
+    }
+    if (Ctx->DupeStats.CantReadFiles){
+        Print(TEXT("  %d files could not be opened\n"), Ctx->DupeStats.CantReadFiles);
+    }
+}
+
+//--------------------------------------------------------------------------
+// Scan the file patterns, resolve the groups and act on the duplicates.
+//--------------------------------------------------------------------------
+static int RunScan(void)
+{
+    int argn;
+    TCHAR DefaultDrive;
+    TCHAR DriveUsed = '\0';
+
+    if (Ctx->NumTiers == 0){
+        // Signature of the first 32k, as it always was.
+        Ctx->Tiers[0].Kind = TIER_HEAD;
+        Ctx->Tiers[0].Blocks = 1;
+        Ctx->Tiers[0].Bytes = BYTES_DO_CHECKSUM_OF;
+        Ctx->NumTiers = 1;
     }
+    Ctx->Tiers[Ctx->NumTiers].Kind = TIER_FULL;
+    for (int c = 0; c < 64; c++) Ctx->PrefixBytes[c] = Ctx->Tiers[0].Bytes;
+
+    InitTiming();
+    if (Ctx->ShowTiming) StartTimingRequests();
+    InitCacheHints();
+    if (Ctx->CacheHints < 0) Ctx->CacheHints = CACHE_SEQUENTIAL | CACHE_PREFETCH;
+    PollControlFile();
+    if (Ctx->MetricsFileName) StartMetrics();
+    StartProgress();
+    if (Ctx->IdlePriority){
+        // Also for opening files in -listlink mode.
+        SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_BEGIN);
+    }
+
+    if (Ctx->NumThreads == 0){
+        SYSTEM_INFO SysInfo;
+        GetSystemInfo(&SysInfo);
+        Ctx->NumThreads = SysInfo.dwNumberOfProcessors > 8 ? 8 : SysInfo.dwNumberOfProcessors;
+        if (Ctx->NumThreads < 1) Ctx->NumThreads = 1;
+    }
+
+    #ifdef REF_CODE
+    Ctx->RefDirSet = kh_init(refdir);
     #endif
 
-    if (BatchFileName) {
-        BatchFile = _tfopen(BatchFileName, TEXT("w"));
-        if (BatchFile == NULL) {
-            _ftprintf(stderr, TEXT("Unable to open task batch file '%s'\n"), BatchFileName);
-            exit(EXIT_FAILURE);
+    if (Ctx->BatchFileName) {
+        Ctx->BatchFile = _tfopen(Ctx->BatchFileName, TEXT("w"));
+        if (Ctx->BatchFile == NULL) {
+            PrintError(TEXT("Unable to open task batch file '%s'\n"), Ctx->BatchFileName);
+            return EXIT_FAILURE;
         }
-        _ftprintf(BatchFile, TEXT("@echo off\n"));
-        _ftprintf(BatchFile, TEXT("REM Batch file for replacing duplicates with hard links\n"));
-        _ftprintf(BatchFile, TEXT("REM created by finddupe program\n"));
-        _ftprintf(BatchFile, TEXT("chcp 65001\n\n"));
+        _ftprintf(Ctx->BatchFile, TEXT("@echo off\n"));
+        _ftprintf(Ctx->BatchFile, TEXT("REM Batch file for replacing duplicates with hard links\n"));
+        _ftprintf(Ctx->BatchFile, TEXT("REM created by finddupe program\n"));
+        _ftprintf(Ctx->BatchFile, TEXT("chcp 65001\n\n"));
     }
 
-    memset(&DupeStats, 0, sizeof(DupeStats));
-
     {
         TCHAR CurrentDir[_MAX_PATH];
         _tgetcwd(CurrentDir, _MAX_PATH);
@@ -1136,109 +3529,276 @@ int _tmain (int argc, TCHAR **argv)
         CheckFileSystem(DefaultDrive);
     }
 
-    FilenameSet = kh_init(hset);
-    FileDataMap = kh_init(hmap);
+    Ctx->FilenameSet = kh_init(pathset);
+    Ctx->FileDataMap = kh_init(hmap);
+    Ctx->LinkGroupMap = kh_init(hlink);
 
-    for (;argn<argc;argn++){
+    for (argn=0;argn<Ctx->NumPatterns;argn++){
+        TCHAR * Pattern;
         int a;
         TCHAR Drive;
-        FilesMatched = 0;
+        Ctx->FilesMatched = 0;
 
-        if (!_tcscmp(argv[argn],TEXT("-ref"))){
-            ReferenceFiles = 1;
+        if (!_tcscmp(Ctx->Patterns[argn],TEXT("-ref"))){
+            Ctx->ReferenceFiles = 1;
             argn += 1;
-            if (argn >= argc) continue;
+            if (argn >= Ctx->NumPatterns) continue;
         }else{
-            ReferenceFiles = 0;
+            Ctx->ReferenceFiles = 0;
         }
+        Pattern = Ctx->Patterns[argn];
 
         for (a=0;;a++){
-            if (argv[argn][a] == '\0') break;
-            if (argv[argn][a] == '/') argv[argn][a] = '\\';
+            if (Pattern[a] == '\0') break;
+            if (Pattern[a] == '/') Pattern[a] = '\\';
         }
 
-        if (argv[argn][1] == ':'){
-            Drive = tolower(argv[argn][0]);
+        if (Pattern[1] == ':'){
+            Drive = tolower(Pattern[0]);
         }else{
             Drive = DefaultDrive;
         }
         if (DriveUsed == '\0') DriveUsed = Drive;
         if (DriveUsed != Drive){
-            if (MakeHardLinks){
-                _ftprintf(stderr, TEXT("Error: Hardlinking across different drives not possible\n"));
-                kh_destroy(hset, FilenameSet);
-                kh_destroy(hmap, FileDataMap);
+            if (Ctx->MakeHardLinks){
+                PrintError(TEXT("Error: Hardlinking across different drives not possible\n"));
                 return EXIT_FAILURE;
             }
         }
 
-        if (_tcslen(argv[argn]) >= 2 && argv[argn][0] == '\\' && argv[argn][1] == '\\' && (BatchFileName || MakeHardLinks))
+        if (_tcslen(Pattern) >= 2 && Pattern[0] == '\\' && Pattern[1] == '\\' && (Ctx->BatchFileName || Ctx->MakeHardLinks))
         {
             ClearProgressInd();
-            _ftprintf(stderr, TEXT("Cannot make hardlinks on network shares\n"));
-            kh_destroy(hset, FilenameSet);
-            kh_destroy(hmap, FileDataMap);
+            PrintError(TEXT("Cannot make hardlinks on network shares\n"));
             return EXIT_FAILURE;
         }
-        else if (_tcslen(argv[argn]) >= 3 && argv[argn][1] == ':' && argv[argn][2] == '\\') {
-            CheckFileSystem(argv[argn][0]);
+        else if (_tcslen(Pattern) >= 3 && Pattern[1] == ':' && Pattern[2] == '\\') {
+            CheckFileSystem(Pattern[0]);
         }
 
         // Use my globbing module to do fancier wildcard expansion with recursive
         // subdirectories under Windows.
-        MyGlob(argv[argn], FollowReparse, ProcessFile);
+        MyGlob(Pattern, Ctx->FollowReparse, SelectProcessFile());
 
-        if (!FilesMatched){
-            _ftprintf(stderr, TEXT("Error: No files matched '%s'\n"), argv[argn]);
+        if (!Ctx->FilesMatched){
+            PrintError(TEXT("Error: No files matched '%s'\n"), Pattern);
         }
     }
 
-    kh_destroy(hset, FilenameSet);
+    kh_destroy(pathset, Ctx->FilenameSet);
+    Ctx->FilenameSet = NULL;
 
-    if (HardlinkSearchMode){
-        ClearProgressInd();
-        _tprintf(TEXT("\n"));
-        DupeStats.HardlinkGroups = 0;
-        // get tree roots for each file size and walk it
+    if (!Ctx->HardlinkSearchMode) ResolveGroups();
+    StopProgress();
+
+    if (Ctx->HardlinkSearchMode){
+        // Complete groups were printed during the scan, print the partial ones
+        // and the instances found after a group was printed.
         khint_t k;
-        for (k = kh_begin(FileDataMap); k != kh_end(FileDataMap); ++k)
-            if (kh_exist(FileDataMap, k))
-                WalkTree(kh_value(FileDataMap, k), NULL, 0);
-        _tprintf(TEXT("\nNumber of hardlink groups found: %d\n"), DupeStats.HardlinkGroups);
+        for (k = kh_begin(Ctx->LinkGroupMap); k != kh_end(Ctx->LinkGroupMap); ++k)
+            if (kh_exist(Ctx->LinkGroupMap, k) && kh_value(Ctx->LinkGroupMap, k).Printed != kh_value(Ctx->LinkGroupMap, k).Last)
+                PrintLinkGroup(&kh_value(Ctx->LinkGroupMap, k));
+        kh_destroy(hlink, Ctx->LinkGroupMap);
+        Ctx->LinkGroupMap = NULL;
     }else{
-        if (DupeStats.TotalFiles == 0){
-            _ftprintf(stderr, TEXT("No files to process\n"));
+        if (Ctx->DupeStats.TotalFiles == 0){
+            PrintError(TEXT("No files to process\n"));
             return EXIT_FAILURE;
         }
 
-        if (BatchFile){
-            fclose(BatchFile);
-            BatchFile = NULL;
+        if (Ctx->BatchFile){
+            fclose(Ctx->BatchFile);
+            Ctx->BatchFile = NULL;
         }
+    }
+    if (!Ctx->OnGroup) PrintSummary();
+    if (Ctx->ShowTiming) PrintTiming();
 
-        // Print summary data
-        ClearProgressInd();
-        UINT64 totalBytes = ((UINT64)(DupeStats.TotalBytes / 1024) == 0 && DupeStats.TotalBytes > 0) ? 1 : DupeStats.TotalBytes / 1024;
-        UINT64 duplicateBytes = ((UINT64)(DupeStats.DuplicateBytes / 1024) == 0 && DupeStats.DuplicateBytes > 0) ? 1 : DupeStats.DuplicateBytes / 1024;
-        _tprintf(TEXT("\n"));
-        _tprintf(TEXT("Files: %8llu kBytes in %5d files\n"), 
-                totalBytes, DupeStats.TotalFiles);
-        _tprintf(TEXT("Dupes: %8llu kBytes in %5d files\n"), 
-                duplicateBytes, DupeStats.DuplicateFiles);
+    return EXIT_SUCCESS;
+}
+
+//--------------------------------------------------------------------------
+// Stop what the scan started, also when it ended early on an error.
+//--------------------------------------------------------------------------
+static void EndScan(void)
+{
+    StopProgress();
+    if (Ctx->TraceFile) CloseTrace();
+    if (Ctx->MetricsStop) StopMetrics();
+    if (Ctx->BatchFile){
+        fclose(Ctx->BatchFile);
+        Ctx->BatchFile = NULL;
     }
-    if (DupeStats.ZeroLengthFiles){
-        _tprintf(TEXT("  %d files of zero length were skipped\n"), DupeStats.ZeroLengthFiles);
+    StopTimingRequests();
+    if (Ctx->IdlePriority) SetThreadPriority(GetCurrentThread(), THREAD_MODE_BACKGROUND_END);
+}
+
+//--------------------------------------------------------------------------
+// The library interface (finddupe.h).  Each call works on the scan it is
+// given, and puts back the scan the thread had before, in case a callback
+// runs a scan of its own.
+//--------------------------------------------------------------------------
+Finddupe_t * FinddupeNew(void)
+{
+    Finddupe_t * Scan = (Finddupe_t *)calloc(1, sizeof(Finddupe_t));
+    LARGE_INTEGER Freq;
+    DWORD Mode;
+
+    if (Scan == NULL) return NULL;
+
+    Scan->PrintDuplicates = 1;
+    Scan->ShowProgress = 1;
+    Scan->SkipZeroLength = 1;
+    Scan->HddThreads = 1;
+    Scan->CacheHints = -1;
+    Scan->ReadStage = STAGE_FULL;
+    QueryPerformanceFrequency(&Freq);
+    Scan->CounterFrequency = Freq.QuadPart;
+    if (GetConsoleMode(GetStdHandle(STD_OUTPUT_HANDLE), &Mode)){
+        Scan->NewConsoleMode = (Mode & ENABLE_VIRTUAL_TERMINAL_PROCESSING) != 0;
     }
-    if (DupeStats.IgnoredFiles) {
-        _tprintf(TEXT("  %d files were ignored\n"), DupeStats.IgnoredFiles);
+    InitializeCriticalSection(&Scan->ConsoleLock);
+    InitializeCriticalSection(&Scan->TraceLock);
+    InitializeCriticalSection(&Scan->ThrottleLock);
+    InitializeCriticalSection(&Scan->BufferLock);
+    return Scan;
+}
+
+int FinddupeOptions(Finddupe_t * Scan, int argc, TCHAR ** argv)
+{
+    Finddupe_t * Outer = Ctx;
+    int Result;
+
+    Ctx = Scan;
+    Scan->Owner = GetCurrentThreadId();
+    if (setjmp(Scan->Abort) == 0){
+        Result = ParseOptions(argc, argv);
+    }else{
+        Result = EXIT_FAILURE;
     }
-    if (DupeStats.CantReadFiles){
-        _tprintf(TEXT("  %d files could not be opened\n"), DupeStats.CantReadFiles);
+    Scan->Owner = 0;
+    Ctx = Outer;
+    return Result;
+}
+
+void FinddupeCallbacks(Finddupe_t * Scan, FinddupeGroupFunc_t OnGroup,
+    FinddupeProgressFunc_t OnProgress, FinddupeOutputFunc_t OnOutput, void * User)
+{
+    Scan->OnGroup = OnGroup;
+    Scan->OnProgress = OnProgress;
+    Scan->OnOutput = OnOutput;
+    Scan->User = User;
+}
+
+int FinddupeRun(Finddupe_t * Scan)
+{
+    Finddupe_t * Outer = Ctx;
+    int Result;
+
+    Ctx = Scan;
+    Scan->Owner = GetCurrentThreadId();
+    if (setjmp(Scan->Abort) == 0){
+        Result = RunScan();
+    }else{
+        Result = EXIT_FAILURE;
     }
+    EndScan();
+    if (Scan->Failed) Result = EXIT_FAILURE;
+    Scan->Owner = 0;
+    Ctx = Outer;
+    return Result;
+}
 
-    SetConsoleMode(hConsole, mode);
+const FinddupeStats_t * FinddupeStats(const Finddupe_t * Scan)
+{
+    return &Scan->DupeStats;
+}
 
-    kh_destroy(hmap, FileDataMap);
+void FinddupeFree(Finddupe_t * Scan)
+{
+    Finddupe_t * Outer = Ctx;
+    khint_t k;
+    int a;
 
-    return EXIT_SUCCESS;
+    if (Scan == NULL) return;
+    Ctx = Scan;
+
+    for (a = 0; a < Ctx->NumFileDataBlocks; a++) free(Ctx->FileDataBlocks[a]);
+    free(Ctx->FileDataBlocks);
+    for (a = 0; a < Ctx->NumNameBlocks; a++) free(Ctx->NameBlocks[a]);
+    free(Ctx->NameBlocks);
+    kh_destroy(pathset, Ctx->FilenameSet);
+    kh_destroy(hmap, Ctx->FileDataMap);
+    kh_destroy(hlink, Ctx->LinkGroupMap);
+    #ifdef REF_CODE
+    if (Ctx->RefDirSet){
+        for (k = kh_begin(Ctx->RefDirSet); k != kh_end(Ctx->RefDirSet); ++k){
+            if (kh_exist(Ctx->RefDirSet, k)) free((void *)kh_key(Ctx->RefDirSet, k));
+        }
+        kh_destroy(refdir, Ctx->RefDirSet);
+    }
+    #endif
+    for (a = 0; a < Ctx->IgnorePatternsCount; a++) free(Ctx->IgnorePatterns[a]);
+    free(Ctx->IgnorePatterns);
+    for (a = 0; a < Ctx->IgnoreDirPatternsCount; a++) free(Ctx->IgnoreDirPatterns[a]);
+    free(Ctx->IgnoreDirPatterns);
+    for (a = 0; a < Ctx->NumPatterns; a++) free(Ctx->Patterns[a]);
+    free(Ctx->Patterns);
+
+    free(Ctx->GroupMembers);
+    free(Ctx->GroupFiles);
+    free(Ctx->Candidates);
+    free(Ctx->CandidateLink);
+    free(Ctx->CandidateState);
+    free(Ctx->GroupEnd);
+    free(Ctx->OldEnd);
+    free(Ctx->Keepers);
+    free(Ctx->ClassOf);
+    free(Ctx->ClassSize);
+    free(Ctx->ReadJobs);
+    free(Ctx->Volumes);
+    free(Ctx->Devices);
+    for (a = 0; a < Ctx->NumFreeBuffers; a++) VirtualFree(Ctx->FreeBuffers[a], 0, MEM_RELEASE);
+
+    DeleteCriticalSection(&Ctx->ConsoleLock);
+    DeleteCriticalSection(&Ctx->TraceLock);
+    DeleteCriticalSection(&Ctx->ThrottleLock);
+    DeleteCriticalSection(&Ctx->BufferLock);
+    free(Scan);
+    Ctx = Outer;
+}
+
+#ifndef FINDDUPE_LIB
+//--------------------------------------------------------------------------
+// The main program.
+//--------------------------------------------------------------------------
+int _tmain (int argc, TCHAR **argv)
+{
+    Finddupe_t * Scan;
+    int Result;
+
+    _tsetlocale(LC_CTYPE, TEXT(".UTF8"));
+#ifdef UNICODE
+    _setmode(_fileno(stdout), _O_U16TEXT);
+    _setmode(_fileno(stderr), _O_U16TEXT);
+#endif
+
+    HANDLE hConsole = GetStdHandle(STD_OUTPUT_HANDLE);
+    DWORD mode = 0;
+    GetConsoleMode(hConsole, &mode);
+    SetConsoleMode(hConsole, mode | ENABLE_PROCESSED_OUTPUT | ENABLE_VIRTUAL_TERMINAL_PROCESSING);
+
+    Scan = FinddupeNew();
+    if (Scan == NULL){
+        _ftprintf(stderr, TEXT("Malloc failure"));
+        return EXIT_FAILURE;
+    }
+    Result = FinddupeOptions(Scan, argc, argv);
+    if (Result == EXIT_SUCCESS) Result = FinddupeRun(Scan);
+    FinddupeFree(Scan);
+
+    SetConsoleMode(hConsole, mode);
+
+    return Result;
 }
+#endif
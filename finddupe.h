@@ -0,0 +1,103 @@
+//--------------------------------------------------------------------------------
+// Interface of the finddupe engine, for programs that scan in-process.
+// Build finddupe.c with FINDDUPE_LIB defined (makefile target finddupe.lib).
+//
+// A scan is set up with the same options as the command line, then run:
+//
+//     Finddupe_t * Scan = FinddupeNew();
+//     FinddupeOptions(Scan, argc, argv);       // eg. -p -hardlink d:\**
+//     FinddupeCallbacks(Scan, OnGroup, OnProgress, OnOutput, User);
+//     if (FinddupeRun(Scan) == EXIT_SUCCESS) ... FinddupeStats(Scan) ...
+//     FinddupeFree(Scan);
+//
+// Each scan keeps its own state, so several can run at once on different
+// threads.  A scan object runs once.  Errors are printed to stderr as by the
+// command line version, or passed to the output callback, and the call
+// returns EXIT_FAILURE.
+//
+// This file is part of finddupe.
+//
+// finddupe is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//--------------------------------------------------------------------------------
+#pragma once
+
+typedef struct Finddupe_t Finddupe_t;
+
+// A file of a group, as passed to the group callback.
+typedef struct {
+    const TCHAR * FileName;
+    UINT64 FileSize;
+    int IsReference;         // Matched by a -ref pattern, never eliminated
+    int Hardlinked;          // Same physical file as the first of the group
+}FinddupeFile_t;
+
+// Called once for each group of files with equal content, after the
+// duplicates were acted on.  The first file is the one that was kept.  In
+// -listlink mode, called once for each group of hardlinked instances.  Runs
+// on the thread of FinddupeRun.  While set, duplicates and the summary are
+// not printed.
+typedef void (*FinddupeGroupFunc_t)(void * User, const FinddupeFile_t * Files, int NumFiles);
+
+typedef struct {
+    const TCHAR * Stage;     // Read stage running, NULL while scanning
+    int FilesScanned;        // Of all file patterns so far
+    UINT64 BytesScanned;
+    double FilesPerSecond;
+    int ReadsDone;           // Of the current read stage
+    int ReadsQueued;
+    UINT64 BytesRead;
+    double BytesPerSecond;
+    int CandidatesLeft;      // Files in groups of equal size not resolved yet
+    double SecondsLeft;      // -1 while not known
+}FinddupeProgress_t;
+
+// Called five times a second, on a thread of its own.  While set, the
+// progress line is not printed.
+typedef void (*FinddupeProgressFunc_t)(void * User, const FinddupeProgress_t * Progress);
+
+// Gets what the scan would print to stdout (IsError 0) or stderr (IsError 1),
+// a message or part of a line at a time.  Runs on the thread of FinddupeRun,
+// or on the progress thread for -timing output on Ctrl+Break.  While set,
+// nothing is printed and there is no progress line.
+typedef void (*FinddupeOutputFunc_t)(void * User, int IsError, const TCHAR * Text);
+
+typedef struct {
+    int TotalFiles;
+    int DuplicateFiles;
+    int HardlinkGroups;
+    int CantReadFiles;
+    int ReadErrors;
+    int ZeroLengthFiles;
+    int IgnoredFiles;
+    int IgnoredDirs;         // Directories pruned by -ign-dir
+    UINT64 TotalBytes;
+    UINT64 DuplicateBytes;
+}FinddupeStats_t;
+
+Finddupe_t * FinddupeNew(void);
+
+// Options and file patterns as on the command line, argv[0] is not looked
+// at.  The strings must stay around until the scan is run, the file patterns
+// are copied.
+int FinddupeOptions(Finddupe_t * Scan, int argc, TCHAR ** argv);
+
+// Any of the callbacks can be NULL.
+void FinddupeCallbacks(Finddupe_t * Scan, FinddupeGroupFunc_t OnGroup,
+    FinddupeProgressFunc_t OnProgress, FinddupeOutputFunc_t OnOutput, void * User);
+
+int FinddupeRun(Finddupe_t * Scan);
+
+const FinddupeStats_t * FinddupeStats(const Finddupe_t * Scan);
+
+void FinddupeFree(Finddupe_t * Scan);
@@ -15,6 +15,12 @@
 // Version 1.25
 // Copyright (C) Jun 2017  thomas694
 //     added unicode support
+// Version 1.35  Oct 2026
+//     prune ignored directories before descending into them
+//     reference directories are handed to finddupe's hash set
+//     pass size and attributes from the directory listing to the callback
+//     pattern splitting moved to SplitPattern, for the microbenchmarks
+//     no globals of finddupe.c used, the scan state is kept per thread there
 //
 // This file is part of finddupe.
 //
@@ -42,31 +48,39 @@
 #define WIN32_LEAN_AND_MEAN // To keep windows.h bloat down.    
 #include <windows.h>
 
+#include "myglob.h"
+
 #define TRUE 1
 #define FALSE 0
 
 //#define DEBUGGING
 #define REF_CODE
 
+// In finddupe.c, for the scan of this thread
 #ifdef REF_CODE
-extern TCHAR* * PathData;
-extern int PathAllocated;
-extern int PathUnique;
-extern int ReferenceFiles;
+void AddRefPath(const TCHAR * Path);
 #endif
+int IsIgnoredDir(const TCHAR * DirName);
+void GlobNoMemory(void);
+
+// Stage timing, in finddupe.c
+#define STAGE_ENUMERATE 0
+LONGLONG TimerStart(void);
+void TimerStop(int Stage, LONGLONG Start);
 
 typedef struct {
     TCHAR * Name;
     int attrib;
+    UINT64 size;
 }FileEntry;
 
 #ifdef DEBUGGING
 //--------------------------------------------------------------------------------
 // Dummy function to show operation.
 //--------------------------------------------------------------------------------
-void ShowName(const TCHAR * FileName)
+void ShowName(const GlobEntry_t * Entry)
 {
-    _tprintf(TEXT("     %s\n"), FileName);
+    _tprintf(TEXT("     %s %llu\n"), Entry->FileName, Entry->FileSize);
 }
 #endif
 
@@ -140,38 +154,20 @@ int IsReparsePoint(TCHAR * DirName)
 }
 
 //--------------------------------------------------------------------------------
-// Decide how a particular pattern should be handled, and call function for each.
+// Split the path into base path and pattern to match against using findfirst.
+// A "**" component is taken out of the pattern, and its position returned in
+// StarStarAt (-1 if none).  Returns TRUE if the pattern continues past the
+// wildcard level, so directories have to be matched.
 //--------------------------------------------------------------------------------
-static void Recurse(const TCHAR * Pattern, int FollowReparse, void (*FileFuncParm)(const TCHAR * FileName))
+static int SplitPattern(TCHAR * PatCopy, int * BaseEnd, int * PatternEnd, int * StarStarAt)
 {
-    TCHAR BasePattern[_MAX_PATH];
-    TCHAR MatchPattern[_MAX_PATH];
-    TCHAR PatCopy[_MAX_PATH*2];
-    #ifdef REF_CODE
-    TCHAR * refpath;
-    #endif
-
     int a;
-    int MatchDirs;
-    int BaseEnd, PatternEnd;
-    int SawPat;
-    int StarStarAt;
+    int SawPat = FALSE;
 
-    _tcscpy(PatCopy, Pattern);
+    *BaseEnd = 0;
+    *PatternEnd = 0;
+    *StarStarAt = -1;
 
-    #ifdef DEBUGGING
-        _tprintf(TEXT("\nCalled with '%s'\n"), Pattern);
-    #endif
-
-DoExtraLevel:
-    MatchDirs = TRUE;
-    BaseEnd = 0;
-    PatternEnd = 0;
-
-    SawPat = FALSE;
-    StarStarAt = -1;
-
-    // Split the path into base path and pattern to match against using findfirst.
     for (a=0;;a++){
         if (PatCopy[a] == '*' || PatCopy[a] == '?'){
             SawPat = TRUE;
@@ -181,7 +177,7 @@ DoExtraLevel:
             if (a == 0 || PatCopy[a-1] == '\\' || PatCopy[a-1] == ':'){
                 if (PatCopy[a+2] == '\\' || PatCopy[a+2] == '\0'){
                     // x\**\y  ---> x\y  x\*\**\y
-                    StarStarAt = a;
+                    *StarStarAt = a;
                     if (PatCopy[a+2]){
                         #ifdef UNICODE
                         wmemcpy(PatCopy+a, PatCopy+a+3, _tcslen(PatCopy)-a-1);
@@ -196,16 +192,39 @@ DoExtraLevel:
         }
 
         if (PatCopy[a] == '\\' || (PatCopy[a] == ':' && PatCopy[a+1] != '\\')){
-            PatternEnd = a;
+            *PatternEnd = a;
             if (SawPat) break; // Findfirst can only match one level of wildcard at a time.
-            BaseEnd = a+1;
+            *BaseEnd = a+1;
         }
         if (PatCopy[a] == '\0'){
-            PatternEnd = a;
-            MatchDirs = FALSE;
-            break;
+            *PatternEnd = a;
+            return FALSE;
         }
     }
+    return TRUE;
+}
+
+//--------------------------------------------------------------------------------
+// Decide how a particular pattern should be handled, and call function for each.
+//--------------------------------------------------------------------------------
+static void Recurse(const TCHAR * Pattern, int FollowReparse, GlobFunc_t FileFuncParm)
+{
+    TCHAR BasePattern[_MAX_PATH];
+    TCHAR MatchPattern[_MAX_PATH];
+    TCHAR PatCopy[_MAX_PATH*2];
+    int a;
+    int MatchDirs;
+    int BaseEnd, PatternEnd;
+    int StarStarAt;
+
+    _tcscpy(PatCopy, Pattern);
+
+    #ifdef DEBUGGING
+        _tprintf(TEXT("\nCalled with '%s'\n"), Pattern);
+    #endif
+
+DoExtraLevel:
+    MatchDirs = SplitPattern(PatCopy, &BaseEnd, &PatternEnd, &StarStarAt);
 
     _tcsncpy(BasePattern, PatCopy, BaseEnd);
     BasePattern[BaseEnd] = 0;
@@ -218,19 +237,8 @@ DoExtraLevel:
     #endif
 
     #ifdef REF_CODE
-        if (MatchDirs == 0 && ReferenceFiles) {
-            if (PathUnique >= PathAllocated) {
-                // Array is full.  Make it bigger
-                PathAllocated = PathAllocated + PathAllocated/2;
-                PathData = realloc(PathData, sizeof(TCHAR*) * PathAllocated);
-                if (PathData == NULL){
-                    _ftprintf(stderr, TEXT("Malloc failure"));
-                    exit(EXIT_FAILURE);
-                }
-            };
-            refpath = _tcsdup(BasePattern);
-            PathData[PathUnique] = refpath;
-            PathUnique += 1;
+        if (MatchDirs == 0) {
+            AddRefPath(BasePattern);
         }
     #endif
 
@@ -239,10 +247,11 @@ DoExtraLevel:
         int NumAllocated = 0;
         int NumHave = 0;
         
-        struct _tfinddata_t finddata;
+        struct _tfinddata64_t finddata;
         intptr_t find_handle;
+        LONGLONG Start = TimerStart();
 
-        find_handle = _tfindfirst(MatchPattern, &finddata);
+        find_handle = _tfindfirst64(MatchPattern, &finddata);
 
         for (;;){
             if (find_handle == -1) break;
@@ -258,6 +267,10 @@ DoExtraLevel:
 
             if (finddata.attrib & _A_SUBDIR){
                 if (!MatchDirs) goto next_file;
+                if (IsIgnoredDir(finddata.name)){
+                    // Prune the whole subtree here instead of listing it.
+                    goto next_file;
+                }
             }else{
                 if (MatchDirs) goto next_file;
             }
@@ -272,8 +285,7 @@ DoExtraLevel:
             FileList[NumHave].Name = malloc((a+1)*sizeof(TCHAR));
             if (FileList[NumHave].Name == NULL){
                 nomem:
-                _tprintf(TEXT("malloc failure\n"));
-                exit(-1);
+                GlobNoMemory();
             }
             #ifdef UNICODE
             wmemcpy(FileList[NumHave].Name, finddata.name, a+1);
@@ -281,12 +293,14 @@ DoExtraLevel:
             memcpy(FileList[NumHave].Name, finddata.name, a+1);
             #endif
             FileList[NumHave].attrib = finddata.attrib;
+            FileList[NumHave].size = finddata.size;
             NumHave++;
 
             next_file:
-            if (_tfindnext(find_handle, &finddata) != 0) break;
+            if (_tfindnext64(find_handle, &finddata) != 0) break;
         }
         _findclose(find_handle);
+        TimerStop(STAGE_ENUMERATE, Start);
 
         // Sort the list...
         qsort(FileList, NumHave, sizeof(FileEntry), CompareFunc);
@@ -303,7 +317,11 @@ DoExtraLevel:
                 }
             }else{
                 if (CatPath(CombinedName, BasePattern, FileList[a].Name)){
-                    FileFuncParm(CombinedName);
+                    GlobEntry_t Entry;
+                    Entry.FileName = CombinedName;
+                    Entry.FileSize = FileList[a].size;
+                    Entry.Attrib = FileList[a].attrib;
+                    FileFuncParm(&Entry);
                 }
             }
             free(FileList[a].Name);
@@ -330,7 +348,7 @@ DoExtraLevel:
 //--------------------------------------------------------------------------------
 // Do quick precheck - if no wildcards, and it names a directory, do whole dir.
 //--------------------------------------------------------------------------------
-int MyGlob(const TCHAR * Pattern, int FollowReparse, void (*FileFuncParm)(const TCHAR * FileName))
+int MyGlob(const TCHAR * Pattern, int FollowReparse, GlobFunc_t FileFuncParm)
 {
     int a;
     TCHAR PathCopy[_MAX_PATH];
@@ -351,8 +369,8 @@ int MyGlob(const TCHAR * Pattern, int FollowReparse, void (*FileFuncParm)(const
 
     if (PathCopy[a] == '\0'){
         // No wildcards were specified.  Do a whole tree, or file.
-        struct _stat FileStat;
-        if (_tstat(PathCopy, &FileStat) != 0){
+        struct _stat64 FileStat;
+        if (_tstat64(PathCopy, &FileStat) != 0){
             // There is no file or directory by that name.
             return -1;
             _tprintf(TEXT("Stat failed\n"));
@@ -362,7 +380,11 @@ int MyGlob(const TCHAR * Pattern, int FollowReparse, void (*FileFuncParm)(const
                 Recurse(PathCopy, FollowReparse, FileFuncParm);
             }
         }else{
-            FileFuncParm(PathCopy);
+            GlobEntry_t Entry;
+            Entry.FileName = PathCopy;
+            Entry.FileSize = FileStat.st_size;
+            Entry.Attrib = (FileStat.st_mode & _S_IWRITE) ? 0 : _A_RDONLY;
+            FileFuncParm(&Entry);
         }
     }else{
         // A wildcard was specified.
@@ -375,6 +397,14 @@ int MyGlob(const TCHAR * Pattern, int FollowReparse, void (*FileFuncParm)(const
 
 
 #ifdef DEBUGGING
+LONGLONG TimerStart(void) { return 0; }
+void TimerStop(int Stage, LONGLONG Start) { }
+#ifdef REF_CODE
+void AddRefPath(const TCHAR * Path) { }
+#endif
+int IsIgnoredDir(const TCHAR * DirName) { return 0; }
+void GlobNoMemory(void) { _tprintf(TEXT("malloc failure\n")); exit(-1); }
+
 //--------------------------------------------------------------------------------
 // The main program.
 // debug: -ref "C:\(abc)\**\orig\**" "C:\(abc)"
@@ -385,16 +415,6 @@ int _tmain (int argc, TCHAR **argv)
     int argn;
     TCHAR * arg;
 
-    #ifdef REF_CODE
-    PathUnique = 0;
-    PathAllocated = 64;
-    PathData = malloc(sizeof(TCHAR*)*PathAllocated);
-    if (PathData == NULL){
-        _ftprintf(stderr, TEXT("Malloc failure"));
-        exit(EXIT_FAILURE);
-    }
-    #endif
-
     for (argn=1;argn<argc;argn++){
         MyGlob(argv[argn], 1, ShowName);
     }
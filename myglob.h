@@ -0,0 +1,31 @@
+//--------------------------------------------------------------------------------
+// Interface of the recursive directory file matching module (myglob.c)
+//
+// This file is part of finddupe.
+//
+// finddupe is free software: you can redistribute it and/or modify
+// it under the terms of the GNU General Public License as published by
+// the Free Software Foundation, either version 3 of the License, or
+// (at your option) any later version.
+//
+// This program is distributed in the hope that it will be useful,
+// but WITHOUT ANY WARRANTY; without even the implied warranty of
+// MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+// GNU General Public License for more details.
+//
+// You should have received a copy of the GNU General Public License
+// along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//--------------------------------------------------------------------------------
+#pragma once
+
+// What the directory listing already told us about a matched file, so the
+// callback does not have to open or stat the file again.
+typedef struct {
+    const TCHAR * FileName;  // Path of the file as matched
+    UINT64 FileSize;
+    unsigned Attrib;         // _A_RDONLY, _A_HIDDEN, _A_SYSTEM, _A_ARCH
+}GlobEntry_t;
+
+typedef void (*GlobFunc_t)(const GlobEntry_t * Entry);
+
+int MyGlob(const TCHAR * Pattern, int FollowReparse, GlobFunc_t FileFuncParm);
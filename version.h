@@ -3,7 +3,7 @@
 #define STRINGIZE(s) STRINGIZE2(s)
 
 #define VERSION_MAJOR               1
-#define VERSION_MINOR               34
+#define VERSION_MINOR               35
 #define VERSION_REVISION            0
 #define VERSION_BUILD               0
 